@@ -0,0 +1,148 @@
+#!/usr/bin/env python3
+"""
+Host check of the v5 firmware sun angle model.
+
+The firmware computes the angle with angle() in calc.c from the calibrated
+center bin and the pinhole height VALUE_Z. The arctangent is interpolated
+from the ATAN_KNOTS table. This script reproduces that integer arithmetic
+and compares it with the 2048-entry lt[] lookup table the firmware used
+before, and with the exact arctangent for other heights.
+
+The table held correctly rounded values, so it was within 0.5 mdeg. The
+interpolation is off by up to about 0.1 mdeg before the rounding to whole
+millidegrees, which makes the model error up to about 0.6 mdeg.
+
+    python3 angle_model.py                  # compare against the regenerated table
+    python3 angle_model.py --legacy calc.c  # compare against lt[] parsed from an old calc.c
+    python3 angle_model.py --knots          # print the ATAN_KNOTS table for calc.c
+"""
+
+import argparse
+import math
+import random
+import re
+import sys
+
+SCALE = 8            # Center bin scaling of the firmware
+ZERO_POINT = 1024    # Center bin of the optical axis in SCALE units
+KNOT_STEPS = 64      # Knots of atan(k/KNOT_STEPS) for k = 0..KNOT_STEPS
+KNOT_FRAC = 16       # Knot values are in 1/KNOT_FRAC millidegrees
+LEGACY_Z = 256       # Pinhole height the lt[] table was computed for, in pixels
+
+KNOTS = [round(1000 * math.degrees(math.atan(k / KNOT_STEPS)) * KNOT_FRAC)
+         for k in range(KNOT_STEPS + 1)]
+
+
+def atan_ratio(num, den):
+    """atan(num/den) for 0 <= num <= den in 1/KNOT_FRAC millidegrees, like atan_ratio() in calc.c."""
+    n = num * KNOT_STEPS
+    i = n // den
+    if i >= KNOT_STEPS:
+        return KNOTS[KNOT_STEPS]
+    t = ((n - i * den) << 15) // den
+
+    k = i & ~1
+    s = ((i - k) << 15) + t
+    y0, y1, y2 = KNOTS[k], KNOTS[k + 1], KNOTS[k + 2]
+    d1 = y1 - y0
+    d2 = y2 - 2 * y1 + y0
+    w = ((s >> 1) * (s - 32768)) >> 15
+    return y0 + ((s * d1 + w * d2 + (1 << 14)) >> 15)
+
+
+def angle(middle, value_z):
+    """angle() in calc.c: millidegrees, None if the angle does not fit in int16 (CALC_ERROR)."""
+    offset = abs(middle - ZERO_POINT)
+    height = value_z * SCALE
+    if offset == 0:
+        return 0
+    while height > 0xFFFF:
+        offset >>= 1
+        height >>= 1
+    if offset <= height:
+        a = atan_ratio(offset, height)
+    else:
+        a = 90000 * KNOT_FRAC - atan_ratio(height, offset)
+    mdeg = (a + KNOT_FRAC // 2) // KNOT_FRAC
+    if mdeg > 32767:
+        return None
+    if middle < ZERO_POINT:
+        mdeg = -mdeg
+    return mdeg
+
+
+def legacy_table(path):
+    if path is None:
+        # The table holds atan(k/4096) in millidegrees rounded to the nearest integer
+        return [round(1000 * math.degrees(math.atan(k / 4096))) for k in range(2048)]
+    src = open(path, encoding='latin-1').read()
+    body = re.search(r'lt\[LUT_SIZE\]\s*=\s*\{([^}]*)\}', src)
+    if body is None:
+        sys.exit('no lt[] table in ' + path)
+    return [int(v) for v in re.findall(r'\d+', body.group(1))]
+
+
+def legacy_angle(lt, middle):
+    """angle() in calc.c with the lt[] table."""
+    if middle < ZERO_POINT:
+        return -lt[2 * (ZERO_POINT - middle)]
+    return lt[2 * (middle - ZERO_POINT)]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--legacy', help='calc.c with the old lt[] table')
+    parser.add_argument('--knots', action='store_true', help='print the knot table')
+    args = parser.parse_args()
+
+    if args.knots:
+        print('static const uint32_t ATAN_KNOTS[%d] = {' % (KNOT_STEPS + 1))
+        for i in range(0, KNOT_STEPS + 1, 8):
+            print('    ' + ', '.join('%6d' % v for v in KNOTS[i:i + 8]) + ',')
+        print('};')
+        return
+
+    lt = legacy_table(args.legacy)
+
+    # Every center bin the table covers. The table index is 2*offset, so only
+    # offsets up to 1023 are in range.
+    diff = worst_model = worst_table = 0
+    for middle in range(ZERO_POINT - 1023, ZERO_POINT + 1024):
+        exact = 1000 * math.degrees(math.atan((middle - ZERO_POINT) / (LEGACY_Z * SCALE)))
+        new = angle(middle, LEGACY_Z)
+        old = legacy_angle(lt, middle)
+        diff += new != old
+        worst_model = max(worst_model, abs(new - exact))
+        worst_table = max(worst_table, abs(old - exact))
+
+    print('against lt[] (VALUE_Z = %d): %d of 2047 differ, max error model %.3f mdeg, table %.3f mdeg'
+          % (LEGACY_Z, diff, worst_model, worst_table))
+
+    # Other pinhole heights, including angles past the table range and center bins
+    # shifted by the bias. Angles past int16 must be reported as errors, the ones
+    # within half a millidegree of the limit may go either way.
+    rnd = random.Random(1)
+    worst = 0
+    wrong = errors = 0
+    for _ in range(200000):
+        value_z = rnd.randint(16, 1024)
+        middle = rnd.randint(ZERO_POINT - 4096, ZERO_POINT + 4096)
+        exact = 1000 * math.degrees(math.atan((middle - ZERO_POINT) / (value_z * SCALE)))
+        mdeg = angle(middle, value_z)
+        if mdeg is None:
+            errors += 1
+            wrong += abs(exact) < 32766.5
+        elif abs(exact) > 32767.5:
+            wrong += 1
+        else:
+            worst = max(worst, abs(mdeg - exact))
+    print('random heights: max error %.3f mdeg, %d out of range, %d wrongly reported'
+          % (worst, errors, wrong))
+
+    print('memory: knots %d bytes, table %d bytes' % (4 * len(KNOTS), 2 * len(lt)))
+
+    return 0 if worst_model <= 1.0 and worst <= 1.0 and wrong == 0 else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
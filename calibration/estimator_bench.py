@@ -0,0 +1,228 @@
+#!/usr/bin/env python3
+"""
+Host benchmark of the v5 firmware sub-pixel estimators.
+
+estimate_middle() in calc.c computes the center bin of a profile with the
+estimator selected by ESTIMATOR (CMD_CONFIG_ESTIMATOR):
+
+    0  3-point parabola
+    1  Gaussian fit, a 3-point parabola through log2 of the values above
+       the background
+    2  5-point least-squares parabola
+    3  windowed centroid above the background
+    4  auto: centroid when saturated, 5-point fit for a wide spot and the
+       Gaussian fit otherwise
+
+This script reproduces the rolling filter and the estimators with the
+integer arithmetic of the firmware and runs them on synthetic Gaussian
+spots with random centers, background and noise. It prints the RMS error
+of each estimator in pixels, the result resolution is 1/8 pixel.
+
+    python3 estimator_bench.py                  # default cases
+    python3 estimator_bench.py --trials 500     # quicker run
+    python3 estimator_bench.py --sat-level 450  # other SAT_LEVEL
+"""
+
+import argparse
+import math
+import random
+import sys
+
+SCALE = 8                   # Center bin scaling of the firmware
+INTERVAL = 3                # Rolling filter length
+SHIFT = 2                   # Index lag of the filter, SHIFT in calc.c
+CENTROID_HALF_WIDTH = 4     # Centroid window past the maximum or the saturated region
+
+EST_QUADRATIC, EST_GAUSSIAN, EST_LSQ5, EST_CENTROID, EST_AUTO = range(5)
+NAMES = ['quad', 'gauss', 'lsq5', 'centr', 'auto']
+
+# Log2 of 1 + k/32 for k = 0..32 in Q12, LOG2_LUT in calc.c
+LOG2_LUT = [round(4096 * math.log2(1 + k / 32)) for k in range(33)]
+
+# Spot cases: amplitude above the background and Gaussian sigma in pixels
+CASES = [(200, 0.6), (200, 1.0), (200, 2.0), (60, 4.0), (400, 2.0), (400, 4.0)]
+
+
+def sdiv(n, d):
+    """fx_sdiv() in fixmath.c, rounds toward zero."""
+    q = abs(n) // abs(d)
+    return -q if (n < 0) != (d < 0) else q
+
+
+class Filter:
+    """State of filter_feed() in calc.c after a full pass."""
+
+    def __init__(self, arr, sat_level):
+        self.low_index = self.high_index = self.max_index = 0
+        self.max_value, self.min_value = 1, 65535
+        self.saturated = 0
+        self.peak = [0] * 5
+        pending = 0
+        total = prev = prev2 = 0
+
+        for i in range(256 + SHIFT):
+            if i < 256:
+                total += arr[i]
+            if i >= INTERVAL:
+                total -= arr[i - INTERVAL]
+            if i < SHIFT:
+                continue
+
+            if pending:
+                self.peak[5 - pending] = total
+                pending -= 1
+
+            if total > sat_level and self.low_index == 0:
+                self.low_index = i - SHIFT
+                self.saturated = 1
+            elif total < sat_level and self.low_index != 0 and self.high_index == 0:
+                self.high_index = i - SHIFT
+
+            if 0 < total < self.min_value:
+                self.min_value = total
+            elif total > self.max_value:
+                self.max_value = total
+                self.max_index = i - SHIFT
+                self.peak = [prev2, prev, total, 0, 0]
+                pending = 2
+
+            prev2, prev = prev, total
+
+        if self.low_index != 0 and self.high_index == 0:
+            self.high_index = 255
+
+
+def log2_q12(v):
+    e = 15
+    while not v & 0x8000:
+        v = (v << 1) & 0xFFFF
+        e -= 1
+    k = (v >> 10) & 0x1F
+    frac = v & 0x3FF
+    return (e << 12) + LOG2_LUT[k] + (((LOG2_LUT[k + 1] - LOG2_LUT[k]) * frac) >> 10)
+
+
+def above_background(value, background):
+    return value - background if value > background + 1 else 1
+
+
+def quadratic_offset(peak):
+    y1, y2, y3 = peak
+    total = 2 * (2 * y2 - y1 - y3)
+    if total == 0:
+        return None
+    return sdiv((y3 - y1) * SCALE, total)
+
+
+def gaussian_offset(peak, background):
+    l1, l2, l3 = (log2_q12(above_background(v, background)) for v in peak)
+    total = 2 * (2 * l2 - l1 - l3)
+    if total <= 0:
+        return None
+    return sdiv((l3 - l1) * SCALE, total)
+
+
+def lsq5_offset(peak):
+    s1 = 2 * (peak[4] - peak[0]) + (peak[3] - peak[1])
+    s2 = 2 * (peak[0] + peak[4]) - peak[1] - 2 * peak[2] - peak[3]
+    if s2 >= 0:
+        return quadratic_offset(peak[1:4])
+    offset = sdiv(7 * s1 * SCALE, -10 * s2)
+    return max(-2 * SCALE, min(2 * SCALE, offset))
+
+
+def filtered_value(arr, i):
+    return sum(arr[i:i + INTERVAL])
+
+
+def centroid_center(f, arr):
+    low = high = f.max_index
+    if f.low_index != 0:
+        low = f.low_index
+        high = f.high_index - 1 if f.high_index < 255 else 255
+    low = low - CENTROID_HALF_WIDTH if low > CENTROID_HALF_WIDTH else 0
+    high = high + CENTROID_HALF_WIDTH if high < 255 - CENTROID_HALF_WIDTH else 255
+
+    moment = total = 0
+    for i in range(low, high + 1):
+        value = max(filtered_value(arr, i) - f.min_value, 0)
+        moment += i * value
+        total += value
+    if total == 0:
+        return None
+    return (moment * SCALE + total // 2) // total
+
+
+def auto_estimator(f):
+    if f.saturated:
+        return EST_CENTROID
+    top, left, right = (max(f.peak[i] - f.min_value, 0) for i in (2, 0, 4))
+    return EST_LSQ5 if 2 * (left + right) > 3 * top else EST_GAUSSIAN
+
+
+def estimate_middle(f, arr, estimator):
+    """Center bin in SCALE units without the bias, or None on a calc error."""
+    if f.max_index < SHIFT or f.max_index > 255 - SHIFT:
+        return None
+    if estimator == EST_AUTO:
+        estimator = auto_estimator(f)
+
+    if estimator == EST_CENTROID:
+        return centroid_center(f, arr)
+    if estimator == EST_GAUSSIAN:
+        d = gaussian_offset(f.peak[1:4], f.min_value)
+    elif estimator == EST_LSQ5:
+        d = lsq5_offset(f.peak)
+    else:
+        d = quadratic_offset(f.peak[1:4])
+    return None if d is None else f.max_index * SCALE + d
+
+
+def spot(rnd, center, amplitude, sigma, background, noise):
+    arr = []
+    for i in range(256):
+        v = background + amplitude * math.exp(-0.5 * ((i - center) / sigma) ** 2) + rnd.gauss(0, noise)
+        arr.append(min(255, max(0, round(v))))
+    return arr
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--trials', type=int, default=3000, help='random centers per case')
+    parser.add_argument('--sat-level', type=int, default=600, help='SAT_LEVEL of the firmware')
+    parser.add_argument('--background', type=float, default=5, help='background in counts')
+    parser.add_argument('--noise', type=float, default=2, help='noise sigma in counts')
+    parser.add_argument('--seed', type=int, default=1)
+    args = parser.parse_args()
+
+    print('RMS error in pixels, %d centers per case, SAT_LEVEL %d' % (args.trials, args.sat_level))
+    print('  amp/sigma   ' + ''.join('%7s' % n for n in NAMES) + '  saturated')
+
+    for amplitude, sigma in CASES:
+        rnd = random.Random(args.seed)
+        squares = [0.0] * len(NAMES)
+        counts = [0] * len(NAMES)
+        saturated = 0
+
+        for _ in range(args.trials):
+            center = rnd.uniform(60, 190)
+            arr = spot(rnd, center, amplitude, sigma, args.background, args.noise)
+            f = Filter(arr, args.sat_level)
+            saturated += f.saturated
+
+            # The filtered value at index i is centered on pixel i + 1
+            for e in range(len(NAMES)):
+                middle = estimate_middle(f, arr, e)
+                if middle is None:
+                    continue
+                squares[e] += (middle / SCALE - (center - 1)) ** 2
+                counts[e] += 1
+
+        rms = ''.join('%7.3f' % math.sqrt(s / n) if n else '      -' for s, n in zip(squares, counts))
+        print('  %3d/%-4.1f    %s  %5.1f%%' % (amplitude, sigma, rms, 100.0 * saturated / args.trials))
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
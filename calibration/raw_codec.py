@@ -0,0 +1,232 @@
+#!/usr/bin/env python3
+"""
+Host decoder of the packed raw profiles of the v5 firmware.
+
+CMD_GET_RAW with part RAW_PART_PACKED returns the X and Y profiles of the
+latest frame in one RSP_RAW frame, coded by raw_pack() in rawpack.c. The
+parts RAW_PART_PACKED_X and RAW_PART_PACKED_Y return one profile each for
+frames too noisy to fit both in one response:
+
+    [part, bit stream]
+
+The bit stream is written MSB first and holds the X profile and then the Y
+profile. A profile is its first pixel in 8 bits followed by the differences
+of the next pixels in blocks of RICE_BLOCK. Each block begins with its Rice
+parameter k in 3 bits. Each difference d is zigzag mapped to u = 2d for
+d >= 0 and -2d - 1 for d < 0, and Rice coded: u >> k in unary (ones ended
+by a zero) and the k low bits of u. A quotient of RICE_ESCAPE or more is
+sent as RICE_ESCAPE ones and u in 9 bits. The last byte is padded with zeros.
+
+The encoder here mirrors the firmware, so the script also measures the
+compression ratio:
+
+    python3 raw_codec.py                    # benchmark on synthetic profiles
+    python3 raw_codec.py --frames raw.bin   # benchmark on recorded frames
+    python3 raw_codec.py --decode HEX       # decode the data of an RSP_RAW frame
+
+A recorded frame is 512 bytes: the 256 X pixels and then the 256 Y pixels,
+as downloaded with parts 0 to 3.
+"""
+
+import argparse
+import random
+import sys
+
+PIXELS = 256
+RAW_PART_PACKED = 4
+RAW_PART_PACKED_X = 5
+RAW_PART_PACKED_Y = 6
+RICE_BLOCK = 32      # Differences per Rice parameter
+RICE_ESCAPE = 12     # Quotients from here on are escaped
+RICE_K_MAX = 7
+ESCAPE_BITS = 9      # Zigzag differences of 8-bit pixels are below 512
+PACKED_MAX = 255     # Room in RSP_RAW after the part number
+
+
+def zigzag(d):
+    return 2 * d if d >= 0 else -2 * d - 1
+
+
+def unzigzag(u):
+    return u >> 1 if not u & 1 else -((u + 1) >> 1)
+
+
+def rice_parameter(profile, first, count):
+    """rice_parameter() in rawpack.c: the smallest k with 2^k * count >= sum of u over the block."""
+    total = sum(zigzag(profile[i] - profile[i - 1]) for i in range(first, first + count))
+    k = 0
+    while k < RICE_K_MAX and (count << k) < total:
+        k += 1
+    return k
+
+
+class BitWriter:
+    def __init__(self):
+        self.bits = []
+
+    def put(self, value, n):
+        for i in range(n - 1, -1, -1):
+            self.bits.append((value >> i) & 1)
+
+    def data(self):
+        bits = self.bits + [0] * (-len(self.bits) % 8)
+        return bytes(int(''.join(map(str, bits[i:i + 8])), 2) for i in range(0, len(bits), 8))
+
+
+class BitReader:
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def get(self, n):
+        value = 0
+        for _ in range(n):
+            byte = self.data[self.pos >> 3]
+            value = (value << 1) | ((byte >> (7 - (self.pos & 7))) & 1)
+            self.pos += 1
+        return value
+
+
+def encode_profile(w, profile):
+    w.put(profile[0], 8)
+    for first in range(1, PIXELS, RICE_BLOCK):
+        count = min(RICE_BLOCK, PIXELS - first)
+        k = rice_parameter(profile, first, count)
+        w.put(k, 3)
+        for i in range(first, first + count):
+            u = zigzag(profile[i] - profile[i - 1])
+            q = u >> k
+            if q >= RICE_ESCAPE:
+                w.put((1 << RICE_ESCAPE) - 1, RICE_ESCAPE)
+                w.put(u, ESCAPE_BITS)
+            else:
+                w.put((1 << (q + 1)) - 2, q + 1)
+                w.put(u & ((1 << k) - 1), k)
+
+
+def decode_profile(r):
+    profile = [r.get(8)]
+    for i in range(1, PIXELS):
+        if (i - 1) % RICE_BLOCK == 0:
+            k = r.get(3)
+        q = 0
+        while q < RICE_ESCAPE and r.get(1):
+            q += 1
+        if q == RICE_ESCAPE:
+            u = r.get(ESCAPE_BITS)
+        else:
+            u = (q << k) | r.get(k)
+        profile.append(profile[-1] + unzigzag(u))
+    return profile
+
+
+def pack(*profiles):
+    """raw_pack() in rawpack.c. Returns the data after the part number, or None if it does not fit."""
+    w = BitWriter()
+    for profile in profiles:
+        encode_profile(w, profile)
+    data = w.data()
+    return data if len(data) <= PACKED_MAX else None
+
+
+def unpack(data):
+    """Decode the data of an RSP_RAW frame starting with the part number. Returns (x, y), None for a missing profile."""
+    part, r = data[0], BitReader(data[1:])
+    if part == RAW_PART_PACKED:
+        return decode_profile(r), decode_profile(r)
+    if part == RAW_PART_PACKED_X:
+        return decode_profile(r), None
+    if part == RAW_PART_PACKED_Y:
+        return None, decode_profile(r)
+    raise ValueError('not a packed raw frame')
+
+
+def synthetic_profile(rnd, noise):
+    """Dark background with noise and a gradient, and a Gaussian spot which may saturate."""
+    base = rnd.uniform(5, 40)
+    slope = rnd.uniform(-0.05, 0.05)
+    amplitude = rnd.choice([0, rnd.uniform(20, 200), rnd.uniform(200, 600)])
+    center = rnd.uniform(0, PIXELS - 1)
+    width = rnd.uniform(2, 12)
+    profile = []
+    for i in range(PIXELS):
+        v = base + slope * i + amplitude * 2.718281828 ** (-((i - center) / width) ** 2 / 2)
+        profile.append(max(0, min(255, round(v + rnd.gauss(0, noise)))))
+    return profile
+
+
+def recorded_frames(path):
+    data = open(path, 'rb').read()
+    for i in range(0, len(data) - 2 * PIXELS + 1, 2 * PIXELS):
+        yield list(data[i:i + PIXELS]), list(data[i + PIXELS:i + 2 * PIXELS])
+
+
+def download(x, y):
+    """Responses the master needs for a frame: one packed, two packed or four raw parts."""
+    data = pack(x, y)
+    if data is not None:
+        responses = [bytes([RAW_PART_PACKED]) + data]
+    else:
+        px, py = pack(x), pack(y)
+        if px is None or py is None:
+            return [bytes(1 + PIXELS // 2)] * 4
+        responses = [bytes([RAW_PART_PACKED_X]) + px, bytes([RAW_PART_PACKED_Y]) + py]
+
+    got = [unpack(r) for r in responses]
+    if (got[0][0], got[-1][1]) != (x, y):
+        sys.exit('decoding failed')
+    return responses
+
+
+def benchmark(frames):
+    if not frames:
+        sys.exit('no frames')
+
+    trips = {1: 0, 2: 0, 4: 0}
+    total = 0
+    sizes = []
+    for x, y in frames:
+        responses = download(x, y)
+        trips[len(responses)] += 1
+        total += sum(len(r) for r in responses)
+        if len(responses) == 1:
+            sizes.append(len(responses[0]))
+
+    n = len(frames)
+    print('%d frames: %d in one response, %d in two, %d in four raw parts'
+          % (n, trips[1], trips[2], trips[4]))
+    print('round trips per frame %.2f (raw 4), data %.1f bytes per frame (raw %d), ratio %.2f'
+          % ((trips[1] + 2 * trips[2] + 4 * trips[4]) / n, total / n, 2 * PIXELS + 4,
+             (2 * PIXELS + 4) * n / total))
+    if sizes:
+        sizes.sort()
+        print('single response size: median %d, max %d bytes' % (sizes[len(sizes) // 2], sizes[-1]))
+    return trips[4] == 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--frames', help='recorded frames, 512 bytes each')
+    parser.add_argument('--decode', help='data of an RSP_RAW frame in hex')
+    parser.add_argument('--count', type=int, default=500, help='number of synthetic frames per noise level')
+    args = parser.parse_args()
+
+    if args.decode:
+        for name, profile in zip('xy', unpack(bytes.fromhex(args.decode))):
+            if profile is not None:
+                print(name + ':', ' '.join('%d' % v for v in profile))
+        return 0
+
+    if args.frames:
+        return 0 if benchmark(list(recorded_frames(args.frames))) else 1
+
+    ok = True
+    for noise in (0.5, 1, 2, 4):
+        print('synthetic, background noise %.1f counts RMS:' % noise)
+        rnd = random.Random(1)
+        ok &= benchmark([(synthetic_profile(rnd, noise), synthetic_profile(rnd, noise)) for _ in range(args.count)])
+    return 0 if ok else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
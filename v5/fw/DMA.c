@@ -2,6 +2,7 @@
 #include "DMA.h"
 #include "main.h"
 #include "calc.h"
+#include "platform/event.h"
 
 volatile unsigned char DMA_x_flag;
 volatile unsigned char DMA_y_flag;
@@ -23,16 +24,26 @@ __interrupt void DMA_ISR(void)
             DMA_y_flag = 1;
             break;
         case DMAIV_DMA2IFG:                             // Vector 6 - DMA channel 2 interrupt
-            //DMA2CTL &= ~DMAIFG;
-            //DMA_uart_flag = 1;
+            DMA2CTL &= ~DMAIFG;
+
+            // The last byte is in the transmit buffer. Let the transmit complete
+            // interrupt turn the bus around once it has been shifted out.
+            UCA1IFG &= ~UCTXCPTIFG;
+            UCA1IE = UCTXCPTIE;
             break;
         default:
             break;
     }
+
+    // Wake up the waiting thread when both profiles have been read out
+    if (DMA_x_flag == 1 && DMA_y_flag == 1) {
+        EVENT_POST(EVENT_READOUT);
+        __bic_SR_register_on_exit(LPM0_bits);
+    }
 }
 
-/*Initialize DMA (Direct Memory Access) controller to move data from sensor to array.*/
-void DMA_INIT(){
+/*Initialize DMA (Direct Memory Access) controller to move data from sensor to the given arrays.*/
+void DMA_INIT(uint8_t *x_dst, uint8_t *y_dst){
 
     DMA0CTL &= ~DMAEN;                                      //Disable DMA controller
     DMA1CTL &= ~DMAEN;                                      //Disable DMA controller
@@ -53,7 +64,7 @@ void DMA_INIT(){
 
     /*DMA channel 0 destination address*/
     //DMA0DA = (unsigned short)x_data;                      // Dest single address
-    DMA0DAL = (unsigned short)x_data;
+    DMA0DAL = (unsigned short)x_dst;
 
     /*DMA channel 0 transfer block size*/
     DMA0SZ = 256;                                           // Block size
@@ -71,7 +82,7 @@ void DMA_INIT(){
 
     /*DMA channel 1 destination address*/
     //DMA1DA = (unsigned short)y_data;                      // Dest single address
-    DMA1DAL = (unsigned short)y_data;
+    DMA1DAL = (unsigned short)y_dst;
 
     /*DMA channel 1 transfer block size*/
     DMA1SZ = 256;                                           // Block size
@@ -110,6 +121,56 @@ void DMA_INIT(){
     DMA_y_flag = 0;
 }
 
+/*
+ * Arm DMA channel 2 to move len bytes from src to the bus UART (UCA1) on every UCA1TXIFG.
+ * The DMA interrupt at the end of the block enables the UART transmit complete interrupt.
+ */
+static void DMA_UART_TX_ARM(const uint8_t *src, uint16_t len)
+{
+    DMA2CTL &= ~(DMAEN | DMAIFG);                           //Disable DMA controller
+
+    if (len == 0) {
+        UCA1IFG &= ~UCTXCPTIFG;
+        UCA1IE = UCTXCPTIE;
+        return;
+    }
+
+    DMACTL1 = (DMACTL1 & ~DMA2TSEL_31) | DMA2TSEL__UCA1TXIFG;  // Trigger 17 on Channel 2 corresponds to UCA1TX
+
+    DMA2SAL = (unsigned short)src;                          // Src = frame
+    DMA2DAL = (unsigned short)&UCA1TXBUF;                   // Dest = UART TX, A1
+    DMA2SZ = len;                                           // Block size
+
+    /*Transfer is single byte*/
+    /*DMA channel2 Source address increment by 1 */
+    /*DMA channel2 INT enabled     */
+    DMA2CTL = DMADT_0 + DMASRCINCR_3 + DMADSTINCR_0 + DMASBDB + DMAIE + DMAEN;
+}
+
+/*
+ * Send len bytes from src to the bus UART with DMA channel 2. The first byte is written
+ * here and the channel moves the rest.
+ */
+void DMA_UART_TX(const uint8_t *src, uint16_t len)
+{
+    DMA_UART_TX_ARM(src + 1, len - 1);
+
+    // The first byte starts the transfer
+    UCA1TXBUF = src[0];
+}
+
+/*
+ * Send an address character followed by len bytes from src in the address-bit multiprocessor format.
+ */
+void DMA_UART_TX_ADDRESS(uint8_t address, const uint8_t *src, uint16_t len)
+{
+    DMA_UART_TX_ARM(src, len);
+
+    // The address character starts the transfer. UCTXADDR is cleared by the hardware once it has been sent.
+    UCA1CTLW0 |= UCTXADDR;
+    UCA1TXBUF = address;
+}
+
 void DMA_DISABLE(void)
 {
 
@@ -1,6 +1,8 @@
 #ifndef DMA_H_
 #define DMA_H_
 
+#include <stdint.h>
+
 
 // Global Flags
 extern volatile unsigned char DMA_x_flag;
@@ -9,7 +11,9 @@ extern volatile unsigned char dma_timeout;
 
 
 // Function Definitions
-void DMA_INIT(void);
+void DMA_INIT(uint8_t *x_dst, uint8_t *y_dst);
 void DMA_DISABLE(void);
+void DMA_UART_TX(const uint8_t *src, uint16_t len);
+void DMA_UART_TX_ADDRESS(uint8_t address, const uint8_t *src, uint16_t len);
 
 #endif /* DMA_H_ */
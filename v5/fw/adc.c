@@ -3,14 +3,18 @@
 #include "adc.h"
 #include "calc.h"
 #include "main.h"
+#include "fixmath.h"
+#include "platform/event.h"
 
-volatile unsigned char adc_done;
 volatile int adc_res;
 
 #define CAL_ADC_15T30  *((uint16_t *)0x1A1A)   // Temperature Sensor Calibration-30 C for 1V5
                                                // See device-specific datasheet for TLV table memory mapping
 #define CAL_ADC_15T85  *((uint16_t *)0x1A1C)   // Temperature Sensor Calibration-85 C for 1V5
 
+// Reciprocal of the calibration span CAL_ADC_15T85 - CAL_ADC_15T30
+static FxRecip cal_span_recip;
+
 void ADC_INIT(void)
 {
   // Configure ADC10 - Pulse sample mode; ADC10SC trigger
@@ -26,16 +30,22 @@ void ADC_INIT(void)
 
   __delay_cycles(400);                      // Delay for Ref to settle
 
+  // The calibration values are constant, so the division is done only once
+  int32_t span = (int32_t)CAL_ADC_15T85 - (int32_t)CAL_ADC_15T30;
+  fx_recip_init(&cal_span_recip, span > 0 ? span : 1);
+
 }
 
 // reading internal msp430 temperature sensor
 int16_t read_tempC(void)
 {
-    // int32_t needed because otherwise pre1 and 2 will overflow
-    int32_t adcValue = read_adc_ch(ADC10INCH_10);
-    int32_t pre1 = (adcValue - (int32_t)CAL_ADC_15T30)* (850 - 300);
-    int32_t pre2 = ((int32_t)CAL_ADC_15T85 - (int32_t)CAL_ADC_15T30);
-    int16_t temperature =  pre1 / pre2 + 300;  // in deciDegC
+    // int32_t needed because otherwise pre1 will overflow
+    int16_t adcValue = read_adc_ch(ADC10INCH_10);
+    int32_t pre1 = fx_mul_s16(adcValue - (int16_t)CAL_ADC_15T30, 850 - 300);
+
+    // Divide by the calibration span, rounding toward zero
+    uint32_t quotient = fx_div_recip(pre1 < 0 ? -(uint32_t)pre1 : (uint32_t)pre1, &cal_span_recip);
+    int16_t temperature = (pre1 < 0 ? -(int16_t)quotient : (int16_t)quotient) + 300;  // in deciDegC
 
     // calibrated temperature in deciDegC
     return temperature + TEMPERATURE_BIAS;
@@ -49,13 +59,8 @@ static int read_adc_ch(unsigned char ch) {
 
     ADC10CTL0 &= ~ADC10ENC; //Disable ADC
     ADC10MCTL0 = ADC10SREF_1 + ch; // Select ADC input channel
-    adc_done = 0;
     ADC10CTL0 |= ADC10ENC + ADC10SC; // Sampling and conversion start
-    while(!adc_done) {
-        __bis_SR_register(LPM0_bits + GIE);
-        __no_operation();
-    }
-    adc_done = 0;
+    event_wait(EVENT_ADC);
 
     return adc_res;
 }
@@ -74,7 +79,7 @@ __interrupt void ADC10_ISR(void)
     case 10: break;                          // ADC10IN
     case 12: {
         adc_res = ADC10MEM0;
-        adc_done = 1;
+        EVENT_POST(EVENT_ADC);
 
         __bic_SR_register_on_exit(LPM0_bits);
         break;                          // Clear CPUOFF bit from 0(SR)
@@ -1,7 +1,51 @@
 #include "bus.h"
 
+void bus_init_slots(BusHandle* self, BusFrame* rx_slots, BusFrame* tx_slots) {
+    int i;
+
+    self->rx_slot[0] = &self->frame_rx;
+    for (i = 1; i < BUS_RX_SLOTS; i++)
+        self->rx_slot[i] = &rx_slots[i - 1];
+
+    self->tx_slot[0] = &self->frame_tx;
+    for (i = 1; i < BUS_TX_SLOTS; i++)
+        self->tx_slot[i] = &tx_slots[i - 1];
+
+    self->rx_head = self->rx_count = 0;
+    self->tx_next = 0;
+}
+
 BusFrame* bus_get_tx_frame(BusHandle* self) { // __attribute__((weak)) {
-    return &self->frame_tx;
+    return self->tx_slot[self->tx_next];
+}
+
+void bus_next_tx_frame(BusHandle* self) {
+    if (++self->tx_next >= BUS_TX_SLOTS)
+        self->tx_next = 0;
+}
+
+BusFrame* bus_peek_rx_frame(BusHandle* self) {
+    uint8_t tail;
+
+    if (self->rx_count == 0)
+        return NULL;
+
+    tail = self->rx_head + BUS_RX_SLOTS - self->rx_count;
+    if (tail >= BUS_RX_SLOTS)
+        tail -= BUS_RX_SLOTS;
+    return self->rx_slot[tail];
+}
+
+BusFrame* bus_newest_rx_frame(BusHandle* self) {
+    if (self->rx_count == 0)
+        return NULL;
+
+    return self->rx_slot[self->rx_head == 0 ? BUS_RX_SLOTS - 1 : self->rx_head - 1];
+}
+
+void bus_release_rx_frame(BusHandle* self) {
+    if (self->rx_count > 0)
+        self->rx_count--;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -18,6 +62,7 @@ static uint32_t lfsr31 = 0x23456789;
 
 static uint32_t shift_lfsr(uint32_t lfsr, uint32_t mask) {
     if (lfsr & 1) {
+        lfsr >>= 1;
         lfsr ^= mask;
     } else {
         lfsr >>= 1;
@@ -3,31 +3,87 @@
 
 #include "bus_frame.h"
 
+// Number of receive and transmit slots. The receiver fills the next free receive slot
+// while the slave handles the previous command, and a response is built in one transmit
+// slot while the other is still being sent.
+#define BUS_RX_SLOTS 2
+#define BUS_TX_SLOTS 2
+
+// Bus statistics. The receiver counts in the RX interrupt, so read them with the
+// interrupts disabled.
+typedef struct {
+    uint32_t rx_frames;         // Complete frames seen on the bus
+    uint32_t rx_mine;           // Frames appointed to us with a valid CRC
+    uint32_t rx_bytes;
+    uint32_t sync_errors, len_errors, crc_errors;
+    uint32_t receive_timeouts;
+    uint32_t skipped_frames;    // Frames appointed to other devices
+    uint32_t rx_overruns;       // Bytes dropped because the receive queue was full
+} BusStats;
+
 // NOTE:
 // It expected that user zero initializes the Bus struct. Usually
 // it is defined as a global variable and it is placed in .bss
 // section that is zero-initialized by default at init.
+// bus_init_slots() must be called before the receiver is enabled.
 struct Bus {
     BusFrame frame_rx;
     BusFrame frame_tx;
 
+    // Receive queue. rx_head is the slot being received into and
+    // rx_count the number of received frames waiting for the slave.
+    BusFrame* rx_slot[BUS_RX_SLOTS];
+    uint8_t rx_head;
+    volatile uint8_t rx_count;
+
+    BusFrame* tx_slot[BUS_TX_SLOTS];
+    uint8_t tx_next;
+
 	BusRxState rx_state;
     size_t rx_index, rx_length;
+    uint16_t rx_crc; // CRC of the bytes received so far
+
+    BusStats stats;
 
-    // NOTE: after packet has been received, there should be no
-    // traffic on the bus, so using larger sized error counters
-    // is also possible without needing locks.
-	uint8_t sync_errors, len_errors, crc_errors;
-    uint8_t receive_timeouts;
+    uint32_t baud_rate; // Nominal rate of the active bus speed, maintained by the driver
 
     void* driver;
 };
 
+/*
+ * Attach the additional receive and transmit slots. frame_rx and frame_tx are the
+ * first ones. The frames are large, so the driver may place the others in FRAM.
+ */
+void bus_init_slots(BusHandle *self, BusFrame *rx_slots, BusFrame *tx_slots);
+
 /*
  * Get memory allocation for preparing a frame for transmitting.
+ * The slot is free once the previous response from it has been sent.
  */
 BusFrame *bus_get_tx_frame(BusHandle *self);
 
+/*
+ * Advance to the next transmit slot after a response has been handed to the driver.
+ */
+void bus_next_tx_frame(BusHandle *self);
+
+/*
+ * Oldest received frame in the queue or NULL if the queue is empty.
+ * The frame stays valid until it is released with bus_release_rx_frame().
+ */
+BusFrame *bus_peek_rx_frame(BusHandle *self);
+
+/*
+ * Latest received frame. Valid in the receiver interrupt right after a frame has been queued.
+ */
+BusFrame *bus_newest_rx_frame(BusHandle *self);
+
+/*
+ * Free the oldest received frame for the receiver.
+ * NOTE: Must not race the receiver, call it with the receive interrupt masked.
+ */
+void bus_release_rx_frame(BusHandle *self);
+
 ////////////////////////////////////////////////////////////////////////////////
 // Slave API -- nonblocking
 ////////////////////////////////////////////////////////////////////////////////
@@ -44,16 +100,26 @@ BusFrame* bus_slave_receive(BusHandle* self);
  */
 void bus_slave_send(BusHandle* self, BusFrame* rsp);
 
+/*
+ * Drop a received command without a response, e.g. a broadcast.
+ */
+void bus_slave_discard(BusHandle* self);
+
 
 ////////////////////////////////////////////////////////////////////////////////
 // Master API -- blocking
+// Define BUS_NO_MASTERING_API to leave it out.
 ////////////////////////////////////////////////////////////////////////////////
+#if !defined(BUS_MASTERING_API) && !defined(BUS_NO_MASTERING_API)
+#define BUS_MASTERING_API
+#endif
+
 #ifdef BUS_MASTERING_API
 
 #define BUS_MAX_MASTER_TRIES 10
-#define BUS_MIN_DELAY 5 // ticks
-#define BUS_MASTER_RECEIVE_TIMEOUT 20 // [ms]/[ticks]
-#define MAX_FRAME_DURATION   (1000 * (8 *  256 / 115200)) // [ms]/[ticks]
+#define BUS_MIN_DELAY 5 // [ms]
+#define BUS_MASTER_RECEIVE_TIMEOUT 20 // [ms]
+#define MAX_FRAME_DURATION   (1000UL * 10 * (BUS_DATA_MAX + BUS_OVERHEAD) / 115200) // [ms]
 
 /*
  * Reserve the bus for mastering.
@@ -69,10 +135,18 @@ void bus_master_give(BusHandle* self);
 /*
  * Make a transfer on the bus after reserving it.
  * The function transmits the given command frame to bus and waits for response.
- * Received response frame is returned.
+ * Received response frame is returned. It stays valid until the next transfer or
+ * bus_master_give(). NULL is returned on a timeout and for a broadcast.
+ * The frame must come from bus_get_tx_frame().
  */
 BusFrame* bus_master_transfer(BusHandle* self, BusFrame* cmd);
 
+/*
+ * Transmit a frame after reserving the bus without waiting for a response.
+ * The frame must come from bus_get_tx_frame().
+ */
+void bus_master_send(BusHandle* self, BusFrame* frame);
+
 /*
  * Initialize pseudorandom generator used by the bus mastering implementation.
  */
@@ -34,40 +34,72 @@ const uint16_t crc16_table[256] = {
 		0x4400, 0x84c1, 0x8581, 0x4540, 0x8701, 0x47c0, 0x4680, 0x8641, 0x8201,
 		0x42c0, 0x4380, 0x8341, 0x4100, 0x81c1, 0x8081, 0x4040 };
 
+static inline uint16_t crc16_update(uint16_t crc, uint8_t data) {
+	uint16_t idx = crc16_table[(crc ^ data) & 0xff];
+	return ((crc >> 8) & 0xff) ^ idx;
+}
+
 uint16_t bus_crc16(const uint8_t* data, size_t len) {
 	uint16_t crc = 0xffff;
-	while (len-- > 0) {
-		uint16_t idx = crc16_table[(crc ^ *(data++)) & 0xff];
-		crc = ((crc >> 8) & 0xff) ^ idx;
-	}
+	while (len-- > 0)
+		crc = crc16_update(crc, *(data++));
 	return crc;
 }
 
 int bus_handle_rx_byte(BusHandle* self, uint8_t data) {
-	self->frame_rx.buf[self->rx_index] = data;
+	self->stats.rx_bytes++;
+
+	// Skip the rest of a frame appointed to another device. If bytes were lost,
+	// the inter-byte timeout resets the receiver instead.
+	if (self->rx_state == BUS_STATE_SKIPPING) {
+		if (++self->rx_index >= self->rx_length) {
+			self->stats.rx_frames++;
+			bus_reset_rx(self);
+		}
+		return 0;
+	}
+
+	// No free slot, the frame is dropped
+	if (self->rx_count >= BUS_RX_SLOTS) {
+		self->stats.rx_overruns++;
+		bus_reset_rx(self);
+		return 0;
+	}
+
+	BusFrame* frame = self->rx_slot[self->rx_head];
+	frame->buf[self->rx_index] = data;
+
+	// Running CRC over the header without the sync word and the data.
+	// rx_length is valid from the second length byte on.
+	if (self->rx_index >= 2) {
+		if (self->rx_index == 2)
+			self->rx_crc = 0xffff;
+		if (self->rx_index <= 3 || self->rx_index + BUS_CRC_BYTES < self->rx_length)
+			self->rx_crc = crc16_update(self->rx_crc, data);
+	}
 
 	switch (self->rx_index) {
 	case 0: {
-		if (self->frame_rx.sync_high == BUS_SYNC_HIGH) {
+		if (frame->sync_high == BUS_SYNC_HIGH) {
 			self->rx_state = BUS_STATE_RX_IN_PROGRESS;
 		}
 	} break;
 	case 1: {
-		if (self->frame_rx.sync_low != BUS_SYNC_LOW) {
+		if (frame->sync_low != BUS_SYNC_LOW) {
 			self->rx_state = BUS_STATE_WAITING_FOR_SYNC;
-			self->sync_errors++;
+			self->stats.sync_errors++;
 		} 
 	} break;
 	case 2: {
 		// First length byte
 	} break;
 	case 3: {
-		self->frame_rx.len = (((uint16_t)self->frame_rx.len_high << 8) | self->frame_rx.len_low);
-		if (self->frame_rx.len > BUS_DATA_MAX) {
+		frame->len = (((uint16_t)frame->len_high << 8) | frame->len_low);
+		if (frame->len > BUS_DATA_MAX) {
 			self->rx_state = BUS_STATE_WAITING_FOR_SYNC;
-			self->len_errors++;
+			self->stats.len_errors++;
 		} else {
-			self->rx_length = self->frame_rx.len + BUS_OVERHEAD;
+			self->rx_length = frame->len + BUS_OVERHEAD;
 		}
 	} break;
 #ifdef BUS_EARLY_ADDRESS_SKIP
@@ -75,33 +107,39 @@ int bus_handle_rx_byte(BusHandle* self, uint8_t data) {
 		// Source address. Skip.
 	} break;
 	case 5: {
-		if (data != BUS_MY_ADDRESS) {
-			self->rx_state = BUS_STATE_WAITING_FOR_SYNC;
+		if (!BUS_ADDRESS_IS_MINE(data)) {
+			self->rx_state = BUS_STATE_SKIPPING;
+			self->stats.skipped_frames++;
 		}
 	} break;
 #endif
 	default: {
 		if (self->rx_index + 1 >= self->rx_length) {
+			self->stats.rx_frames++;
 
 			// Check destination address
-			if (self->frame_rx.dst != BUS_MY_ADDRESS) {
+			if (!BUS_ADDRESS_IS_MINE(frame->dst)) {
 				self->rx_state = BUS_STATE_WAITING_FOR_SYNC;
 				break;
 			}
 
-			// Check CRC-16 checksum
-			uint16_t rx_crc = ((uint16_t)self->frame_rx.data[self->frame_rx.len] << 8) | self->frame_rx.data[self->frame_rx.len+1];
-			uint16_t data_crc = bus_crc16(self->frame_rx.buf+2, self->frame_rx.len+5);
-			if (rx_crc == data_crc) {
+			// Check CRC-16 checksum against the running CRC
+			uint16_t rx_crc = ((uint16_t)frame->data[frame->len] << 8) | frame->data[frame->len+1];
+			if (rx_crc == self->rx_crc) {
 				// A successful reception of a frame appointed to our device!
-				self->rx_state = BUS_STATE_RX_PACKET_RECEIVED;
+				// Queue it and continue to the next slot.
+				self->rx_state = BUS_STATE_WAITING_FOR_SYNC;
 				self->rx_index = 0;
+				self->rx_count++;
+				self->stats.rx_mine++;
+				if (++self->rx_head >= BUS_RX_SLOTS)
+					self->rx_head = 0;
 
 				return 1; // Indicate reception of new frame!
 			}
 			else {
 				self->rx_state = BUS_STATE_WAITING_FOR_SYNC;
-				self->crc_errors++;
+				self->stats.crc_errors++;
 			}
 		}
 	} break;
@@ -120,6 +158,16 @@ void bus_reset_rx(BusHandle* self) {
 	self->rx_index = 0;
 }
 
+#ifdef BUS_ADDRESS_BIT_MODE
+int bus_handle_rx_address(BusHandle* self, uint8_t address) {
+	self->stats.rx_bytes++;
+
+	// The address character always begins a new frame
+	bus_reset_rx(self);
+	return BUS_ADDRESS_IS_MINE(address);
+}
+#endif
+
 BusFrame* bus_prepare_tx_frame(BusFrame* rsp)
 {
 	rsp->src = BUS_MY_ADDRESS;
@@ -24,9 +24,33 @@
 #define BUS_MY_ADDRESS ADCS_DSS_YP
 #endif
 
+// Frames to the broadcast address are received by every device and never answered
+#define BUS_ADDRESS_BROADCAST 0x00
+#define BUS_ADDRESS_IS_MINE(addr) ((addr) == BUS_MY_ADDRESS || (addr) == BUS_ADDRESS_BROADCAST)
+
+/*
+ * Frames appointed to other devices are skipped right after the destination byte by
+ * counting off the rest of the frame, so their data is never scanned for a sync word.
+ * Define BUS_NO_EARLY_ADDRESS_SKIP to receive every frame to the end instead.
+ */
+#if !defined(BUS_EARLY_ADDRESS_SKIP) && !defined(BUS_NO_EARLY_ADDRESS_SKIP)
+#define BUS_EARLY_ADDRESS_SKIP
+#endif
+
 #define BUS_SYNC_HIGH 0x5A
 #define BUS_SYNC_LOW  0xCE
 
+/*
+ * Address-bit framing (BUS_ADDRESS_BIT_MODE)
+ *
+ * The UART runs in the address-bit multiprocessor format, where every character carries
+ * a ninth bit. Each frame is preceded by one character with the address bit set, holding
+ * the destination address. The frame itself is unchanged and sent as data characters.
+ * Receivers keep the UART dormant, so only address characters cause an interrupt, and
+ * wake up for the rest of the frame when the address is their own.
+ * All nodes on the bus must use the same framing.
+ */
+
 #define BUS_DATA_MAX 0x100
 #define BUS_HEADER_BYTES 7
 #define BUS_CRC_BYTES 2
@@ -52,6 +76,7 @@ typedef enum {
 	BUS_STATE_WAITING_FOR_SYNC,
 	BUS_STATE_RX_IN_PROGRESS,
 	BUS_STATE_RX_PACKET_RECEIVED,
+	BUS_STATE_SKIPPING, // Counting off a frame appointed to another device
 } BusRxState;
 
 typedef struct Bus BusHandle;
@@ -71,6 +96,14 @@ uint16_t bus_crc16(const uint8_t* data, size_t len);
  */
 void bus_reset_rx(BusHandle* self);
 
+#ifdef BUS_ADDRESS_BIT_MODE
+/*
+ * Handle an address character which starts a new frame.
+ * Returns 1 if the frame is appointed to our device and the receiver should wake up.
+ */
+int bus_handle_rx_address(BusHandle* self, uint8_t address);
+#endif
+
 /*
  * Helper function for preparing tx BusFrame. Fills in sync word, len bytes based
  * on rsp->len and calculates crc. Rest is up to user to fill in correctly.
@@ -1,11 +1,14 @@
 #include "calc.h"
 
 #include <stdint.h>
+#include <string.h>
 #include <msp430.h>
 
 #include "main.h"
 #include "DMA.h"
 #include "SPI.h"
+#include "fixmath.h"
+#include "platform/event.h"
 
 /*
 /////////////////////////////////////////////////////////////////
@@ -33,7 +36,10 @@ uint8_t max_index = 0;
 
 const static uint8_t INTERVAL = 3;                       // This is for the rolling average calculation. Set to 5 by default, must be UNEVEN
 const static uint8_t SHIFT = 2;                          // Shift is used in rolling average, for the array correction. Set to 2 by default formula SHIFT = ((INTERVAL-1)/2)
-const static uint8_t SCALE = 8;                          // This is used for the Quadratic middle calculation. Set to 8 by default
+const static uint8_t SCALE = CENTER_SCALE;               // Center bins are in 1/SCALE pixels, see CENTER_SCALE
+
+// Reciprocal of INTERVAL for the SNR calculation
+static const FxRecip INTERVAL_RECIP = FX_RECIP(3);
 
 // This flag is used to indicated whether or not data is requested by the I2C handler
 volatile uint8_t dataRequested = 0;
@@ -46,9 +52,13 @@ volatile uint8_t dataRequested = 0;
 */
 
 #pragma SET_DATA_SECTION(".fram_vars")
-// Sensor raw data arrays
-uint8_t x_data[256];
-uint8_t y_data[256];
+// Sensor raw data arrays. Two buffer pairs which are used in turns (ping-pong)
+uint8_t x_buffer[2][256];
+uint8_t y_buffer[2][256];
+
+// Burst capture state. Kept over resets for a later download.
+static uint8_t burst_count = 0;
+static uint8_t burst_captured = 0;
 
 
 // FRAM variables and constants
@@ -57,7 +67,7 @@ int16_t Y_BIAS = 0;                    // This value is multiplied by 8, to comp
 // Temperature BIAS
 int16_t TEMPERATURE_BIAS = 0;           // temp bias in deciDegC
 
-uint16_t VALUE_Z = 1;                   // height
+uint16_t VALUE_Z = 256;                 // height in pixels
 
 uint16_t INT_TIME = 3200;              // This is the integration time variable. Tint = 1/0.75MHz*INT_TIME
 uint16_t SAMPLING_TIME = 3200;         // This is the amount of clock ticks it takes to sample the sensor one time MUST BE OVER 3200
@@ -69,8 +79,56 @@ uint16_t SAT_LEVEL = 100;
 // This is the gain of the Sun Sensor which is saved in FRAM
 uint8_t GAIN = 0;
 
+// Acquisition mode (ACQ_MODE_SINGLE or a combination of ACQ_MODE_CONTINUOUS and ACQ_MODE_STREAMING)
+uint8_t ACQ_MODE = ACQ_MODE_SINGLE;
+
+// Sub-pixel estimator used for the center bin calculation
+uint8_t ESTIMATOR = EST_QUADRATIC;
+
 #pragma SET_DATA_SECTION()
 
+/*
+ * Burst capture buffer. As a persistent variable it is allocated with the code in the
+ * writable part of the FRAM region, so the link fails if BURST_FRAMES does not fit in
+ * the FRAM left free by the code. Kept over resets, zeroed when the firmware is loaded.
+ */
+#pragma PERSISTENT(burst_buffer)
+static BurstFrame burst_buffer[BURST_FRAMES] = {{0}};
+
+// Raw profiles of the latest completed frame. The DMA fills the other buffer pair.
+uint8_t *x_data = x_buffer[1];
+uint8_t *y_data = y_buffer[1];
+
+// Index of the buffer pair the next readout is written to
+static uint8_t fill_index = 0;
+
+// Running frame counter
+static volatile uint16_t frame_counter = 0;
+
+// Integration cycles of the sensor, whether read out or not. readout_cycle is the cycle
+// of the readout in progress and data_cycle the one of x_data/y_data.
+static volatile uint16_t cycle_counter = 0;
+static uint16_t readout_cycle = 0;
+static uint16_t data_cycle = 0;
+
+// Result of the latest processed frame
+SensorResult last_result = { .status = SAMPLING_ERROR };
+
+PipelineStats pipeline_stats = { 0 };
+
+// Triggered measurement. trigger_frame is the number of the first frame read out after the
+// trigger. The ticket is the frame number, or the trigger ID of a synchronous trigger.
+static volatile uint8_t trigger_pending = 0;
+static uint16_t trigger_frame = 0;
+static uint16_t trigger_ticket = 0;
+static SensorResult trigger_result = { .status = SAMPLING_ERROR };
+
+// A burst is being captured. Cleared when the sensor is put to sleep.
+static volatile uint8_t burst_active = 0;
+
+// Integration timer ticks per ms (ACLK/2)
+#define ACQ_TIMER_TICKS_PER_MS  6000
+
 // This is used to determine the time during which a DMA transfer should have occured
 uint16_t TIMEOUT_TIME = 3500;                  // Timeout time
 
@@ -101,6 +159,11 @@ __interrupt void INTEGRATION_TIMER_ISR(void)
     }
 
     case 1: {
+        cycle_counter++;
+
+        // In continuous mode every frame is read out unless the previous one is still being processed
+        if (dataRequested == 0 && ((ACQ_MODE & ACQ_MODE_CONTINUOUS) || burst_active)) dataRequested = 1;
+
         if (dataRequested == 1) {
 
             // Clear DMA interrupts
@@ -109,9 +172,14 @@ __interrupt void INTEGRATION_TIMER_ISR(void)
 
             // Reset SPI and DMA
             SPI_RESET();
-            DMA_INIT();
+            DMA_INIT(x_buffer[fill_index], y_buffer[fill_index]);
 
             dataRequested = 2;
+            readout_cycle = cycle_counter;
+
+            // Let a streaming reader know that the DMA is running
+            EVENT_POST(EVENT_READOUT_START);
+            __bic_SR_register_on_exit(LPM0_bits);
         }
 
         // Set INTEGRATION period and clear timer
@@ -128,7 +196,14 @@ __interrupt void INTEGRATION_TIMER_ISR(void)
         break;
     }
     case 2: {
-        if (dataRequested == 2) dma_timeout = 1;
+        // The readout may have completed but not yet been collected by the main loop
+        if (dataRequested == 2 && !(DMA_x_flag == 1 && DMA_y_flag == 1)) {
+            dma_timeout = 1;
+
+            // Wake up the waiting thread
+            EVENT_POST(EVENT_READOUT);
+            __bic_SR_register_on_exit(LPM0_bits);
+        }
 
         ST_SIGNAL_ENABLE();
 
@@ -144,37 +219,431 @@ __interrupt void INTEGRATION_TIMER_ISR(void)
     }
 }
 
+static int readout_done(void)
+{
+    return (DMA_x_flag == 1 && DMA_y_flag == 1) || dma_timeout;
+}
+
+// The readout of the triggered frame failed
+static void trigger_fail(void)
+{
+    if (!trigger_pending)
+        return;
+
+    trigger_pending = 0;
+    trigger_result.frame = trigger_frame;
+    trigger_result.timestamp = get_timestamp();
+    trigger_result.status = SAMPLING_ERROR;
+}
+
+// Keep the result of the triggered frame, or read out another frame if it is still ahead
+static void trigger_complete(const SensorResult *res)
+{
+    __disable_interrupt();
+
+    if (trigger_pending) {
+        if ((int16_t)(res->frame - trigger_frame) < 0) {
+            if (dataRequested == 0) dataRequested = 1;
+        }
+        else {
+            trigger_pending = 0;
+            trigger_result = *res;
+        }
+    }
+
+    __enable_interrupt();
+}
+
+/*
+ * Collect a completed (or timed out) readout. On success the filled buffer pair
+ * becomes x_data/y_data and the next readout goes to the other pair.
+ */
+static int finish_readout(void)
+{
+    // Reset data request variable
+    dataRequested = 0;
+
+    // Disable the DMA and SPI controllers
+    SPI_DISABLE();
+    DMA_DISABLE();
+
+    // Set DMA x and y flags to zero, so that they're ready for the next read
+    DMA_x_flag = 0;
+    DMA_y_flag = 0;
+
+    // Check to see if we sampled the sensor or if a timeout occured
+    if (dma_timeout != 0){
+        // Reset DMA timeout flag
+        dma_timeout = 0;
+        pipeline_stats.dma_timeouts++;
+        trigger_fail();
+        return 0;
+    }
+
+    // Reset DMA timeout flag
+    dma_timeout = 0;
+
+    // Publish the new frame and swap buffers
+    x_data = x_buffer[fill_index];
+    y_data = y_buffer[fill_index];
+    data_cycle = readout_cycle;
+    fill_index ^= 1;
+    frame_counter++;
+
+    return 1;
+}
+
+/*
+ * Copy the frame published by finish_readout() into the burst buffer. Called with the
+ * interrupts enabled, the copy to FRAM is too long to hold off the bus.
+ */
+static void burst_capture(void)
+{
+    if (!burst_active)
+        return;
+
+    BurstFrame *b = &burst_buffer[burst_captured];
+    b->frame = frame_counter;
+    b->cycle = data_cycle;
+    b->timestamp = get_timestamp();
+    b->int_time = INT_TIME;
+    b->gain = GAIN;
+    b->reserved = 0;
+    memcpy(b->x, x_data, sizeof(b->x));
+    memcpy(b->y, y_data, sizeof(b->y));
+
+    if (++burst_captured >= burst_count)
+        burst_active = 0;
+}
+
+/*
+ * Sleep until the DMA or the integration timer signals the end of the readout and collect it.
+ * The interrupts are disabled in between, so a synchronous trigger cannot abort the readout
+ * after it has been found complete.
+ */
+static int wait_readout(void)
+{
+    for (;;) {
+        __disable_interrupt();
+        if (readout_done()) break;
+        __enable_interrupt();
+
+        event_wait(EVENT_READOUT);
+    }
+
+    int ok = finish_readout();
+    __enable_interrupt();
+
+    if (ok) burst_capture();
+    return ok;
+}
+
 int SAMPLE_SENSOR()
 {
 
-    dataRequested = 1;
+    // A triggered readout may already be running
+    if (dataRequested == 0) dataRequested = 1;
 
-    while(1){
-        if((DMA_x_flag == 1 && DMA_y_flag == 1) || dma_timeout){
+    return wait_readout();
+}
 
-            // Reset data request variable
-            dataRequested = 0;
+// Filter and interpolate the latest completed frame
+uint8_t process_frame(SensorResult *res)
+{
+    res->frame = frame_counter;
+    res->timestamp = get_timestamp();
+    res->status = CALC_ERROR;
 
-            // Disable the DMA and SPI controllers
-            SPI_DISABLE();
-            DMA_DISABLE();
+    FilterState f;
 
-            // Set DMA x and y flags to zero, so that they're ready for the next read
-            DMA_x_flag = 0;
-            DMA_y_flag = 0;
+    rolling_filter(x_data, &f);
+    res->peak_x = f.max_index;
+    if (estimate_middle(&f, x_data, 'x') != CALC_OK) return CALC_ERROR;
 
-            // Check to see if we sampled the sensor or if a timeout occured
-            if (dma_timeout != 0){
-                // Reset DMA timeout flag
-                dma_timeout = 0;
-                return 0;
-            }
+    rolling_filter(y_data, &f);
+    res->peak_y = f.max_index;
+    if (estimate_middle(&f, y_data, 'y') != CALC_OK) return CALC_ERROR;
+
+    res->value_x = VALUE_X;
+    res->value_y = VALUE_Y;
+    res->snr_x = SNR_X;
+    res->snr_y = SNR_Y;
+    res->status = CALC_OK;
+
+    return CALC_OK;
+}
 
-            // Reset DMA timeout flag
-            dma_timeout = 0;
-            return 1;
+// Number of pixels the DMA has moved into the buffer during the ongoing readout
+static uint16_t dma_progress(volatile unsigned char *flag, volatile uint16_t *size)
+{
+    // DMAxSZ is valid only after the readout has been armed. It counts down the remaining
+    // transfers and reloads to 256 at the end of the block, so check the done flag first.
+    if (*flag == 1) return 256;
+    if (dataRequested != 2) return 0;
+    return 256 - *size;
+}
+
+/*
+ * Sample the sensor in streaming mode. The rolling filter runs over the pixels the DMA
+ * has already moved while the readout is still going on, so only the interpolation is
+ * left at the end. Returns 0 if the sampling failed.
+ */
+static int sample_and_stream(SensorResult *res)
+{
+    // The readout goes to the buffer pair which becomes x_data/y_data when it is finished
+    const uint8_t *x_arr = x_buffer[fill_index];
+    const uint8_t *y_arr = y_buffer[fill_index];
+    FilterState fx, fy;
+
+    filter_reset(&fx);
+    filter_reset(&fy);
+
+    // A triggered readout may already be running
+    if (dataRequested == 0) dataRequested = 1;
+
+    // Sleep during the integration until the DMA has been armed
+    while (dataRequested == 1 && !readout_done()) event_wait(EVENT_READOUT_START | EVENT_READOUT);
+
+    // Follow the DMA until the last pixel has landed
+    uint16_t frame = frame_counter;
+    while (!readout_done()) {
+        // A synchronous trigger aborted the readout, follow the next one from the start
+        if (frame != frame_counter) {
+            frame = frame_counter;
+            filter_reset(&fx);
+            filter_reset(&fy);
         }
+
+        filter_feed(&fx, x_arr, dma_progress(&DMA_x_flag, &DMA0SZ));
+        filter_feed(&fy, y_arr, dma_progress(&DMA_y_flag, &DMA1SZ));
+    }
+
+    if (!wait_readout()) return 0;
+
+    // The readout was aborted after the last pixel, filter the next one as a whole
+    if (frame_counter != (uint16_t)(frame + 1)) {
+        filter_reset(&fx);
+        filter_reset(&fy);
+    }
+
+    res->frame = frame_counter;
+    res->timestamp = get_timestamp();
+    res->status = CALC_ERROR;
+
+    // Only the tail of the filter and the interpolation is left
+    filter_feed(&fx, x_arr, 256);
+    filter_finish(&fx);
+    res->peak_x = fx.max_index;
+    if (estimate_middle(&fx, x_arr, 'x') != CALC_OK) return 1;
+
+    filter_feed(&fy, y_arr, 256);
+    filter_finish(&fy);
+    res->peak_y = fy.max_index;
+    if (estimate_middle(&fy, y_arr, 'y') != CALC_OK) return 1;
+
+    res->value_x = VALUE_X;
+    res->value_y = VALUE_Y;
+    res->snr_x = SNR_X;
+    res->snr_y = SNR_Y;
+    res->status = CALC_OK;
+
+    return 1;
+}
+
+/*
+ * Sample the sensor and process the frame into res.
+ * Returns 0 if the sampling failed.
+ */
+int sample_and_process(SensorResult *res)
+{
+    int ok;
+
+    if (ACQ_MODE & ACQ_MODE_STREAMING) {
+        ok = sample_and_stream(res);
+    }
+    else {
+        ok = SAMPLE_SENSOR();
+        if (ok) process_frame(res);
+    }
+
+    if (!ok) {
+        pipeline_stats.sampling_errors++;
+        return 0;
+    }
+    if (res->status != CALC_OK)
+        pipeline_stats.calc_errors++;
+
+    // A triggered measurement may be waiting for this frame
+    trigger_complete(res);
+    return 1;
+}
+
+int acquisition_pending(void)
+{
+    return ((ACQ_MODE & ACQ_MODE_CONTINUOUS) || trigger_pending || burst_active) && dataRequested == 2 && readout_done();
+}
+
+/*
+ * Background acquisition. In continuous mode the integration timer arms a readout every cycle
+ * into the free buffer pair. Completed frames are processed here while the sensor integrates
+ * the next one, so commands can answer with last_result right away.
+ */
+void acquisition_process(void)
+{
+    __disable_interrupt();
+    if (!acquisition_pending()) {
+        __enable_interrupt();
+        return;
+    }
+
+    int ok = finish_readout();
+    __enable_interrupt();
+
+    if (!ok) {
+        pipeline_stats.sampling_errors++;
+        last_result.status = SAMPLING_ERROR;
+        last_result.timestamp = get_timestamp();
+        return;
+    }
+
+    burst_capture();
+
+    // A frame read out only for the burst is not processed
+    if (!(ACQ_MODE & ACQ_MODE_CONTINUOUS) && !trigger_pending)
+        return;
+
+    if (process_frame(&last_result) != CALC_OK)
+        pipeline_stats.calc_errors++;
+    trigger_complete(&last_result);
+}
+
+/*
+ * Start a measurement in the background. The first frame read out after the trigger is
+ * processed in acquisition_process() and kept until it is fetched or a new trigger.
+ * Returns the ticket of the measurement.
+ */
+uint16_t acquisition_trigger(void)
+{
+    __disable_interrupt();
+
+    // A frame being read out was integrated before the trigger
+    trigger_frame = frame_counter + (dataRequested == 2 ? 2 : 1);
+    trigger_ticket = trigger_frame;
+    trigger_pending = 1;
+    if (dataRequested == 0) dataRequested = 1;
+
+    uint16_t ticket = trigger_ticket;
+    __enable_interrupt();
+
+    return ticket;
+}
+
+/*
+ * Synchronous trigger, called from the bus receive interrupt at the end of the trigger frame.
+ * The sampling sequence is restarted, so the integration begins SAMPLING_TIME after the frame
+ * on every sensor of the bus. A readout in progress is aborted and its frame number skipped.
+ */
+void acquisition_sync(uint16_t id)
+{
+    INTEGRATION_TIMER_DISABLE();
+    TA0CCTL0 &= ~CCIFG;
+
+    if (dataRequested == 2) {
+        SPI_DISABLE();
+        DMA_DISABLE();
+        DMA_x_flag = 0;
+        DMA_y_flag = 0;
+        dma_timeout = 0;
+        frame_counter++;
     }
+    dataRequested = 1;
+
+    trigger_frame = frame_counter + 1;
+    trigger_ticket = id;
+    trigger_pending = 1;
+
+    // Pull the start pins down and begin the sequence from the sampling period
+    ST_SIGNAL_ENABLE();
+}
+
+uint8_t acquisition_fetch(uint16_t ticket, SensorResult *res)
+{
+    uint8_t state = TRIGGER_DONE;
+
+    __disable_interrupt();
+    if (ticket != trigger_ticket)
+        state = TRIGGER_UNKNOWN;
+    else if (trigger_pending)
+        state = TRIGGER_PENDING;
+    else
+        *res = trigger_result;
+    __enable_interrupt();
+
+    return state;
+}
+
+// Upper bound of a full sampling, integration and readout cycle in ms
+static uint16_t cycle_ms(void)
+{
+    uint32_t cycle = (uint32_t)SAMPLING_TIME + INT_TIME + TIMEOUT_TIME;
+    return fx_udiv(cycle, ACQ_TIMER_TICKS_PER_MS) + 1;
+}
+
+uint16_t acquisition_eta(void)
+{
+    if (!trigger_pending)
+        return 0;
+
+    uint16_t frames = trigger_frame - frame_counter;
+    return fx_mul_u16(frames, cycle_ms());
+}
+
+void burst_start(uint8_t count)
+{
+    __disable_interrupt();
+
+    burst_count = count;
+    burst_captured = 0;
+    burst_active = 1;
+    if (dataRequested == 0) dataRequested = 1;
+
+    __enable_interrupt();
+}
+
+const BurstFrame* burst_frame(uint8_t i)
+{
+    return (i < burst_captured) ? &burst_buffer[i] : NULL;
+}
+
+uint8_t burst_length(void)
+{
+    return burst_count;
+}
+
+uint16_t burst_eta(uint8_t i)
+{
+    if (!burst_active || i < burst_captured)
+        return 0;
+
+    // A frame being read out may have been integrated before the burst started
+    return fx_mul_u16(i - burst_captured + 2, cycle_ms());
+}
+
+void acquisition_reset(void)
+{
+    if (dataRequested != 0) {
+        SPI_DISABLE();
+        DMA_DISABLE();
+    }
+
+    dataRequested = 0;
+    DMA_x_flag = 0;
+    DMA_y_flag = 0;
+    dma_timeout = 0;
+    burst_active = 0;
+
+    last_result.status = SAMPLING_ERROR;
+    trigger_fail();
 }
 
 
@@ -208,19 +677,187 @@ void ST_SIGNAL_DISABLE(void)
 
     // Set the interrupt switch case variable to -1
     int_flag = -1;
+
+    // Readout in progress will never complete
+    acquisition_reset();
 }
 
 
-// Function used to estimate the center bin location through interpolation
+// Log2 of 1 + k/32 for k = 0..32 in Q12, used by the Gaussian estimator
+static const uint16_t LOG2_LUT[33] = {
+       0,  182,  358,  530,  696,  858, 1016, 1169,
+    1319, 1465, 1607, 1746, 1882, 2015, 2145, 2272,
+    2396, 2518, 2637, 2754, 2869, 2982, 3092, 3200,
+    3307, 3412, 3514, 3615, 3715, 3812, 3908, 4003,
+    4096
+};
+
+// Half width of the centroid window when the profile is not saturated
+const static uint8_t CENTROID_HALF_WIDTH = 4;
+
+// Log2 of v in Q12. Valid for 0 < v < 32768.
+static uint16_t log2_q12(uint16_t v)
+{
+    uint16_t e = 15;
+
+    // Normalize so that the leading one is at bit 15
+    while (!(v & 0x8000)) {
+        v <<= 1;
+        e--;
+    }
+
+    // The next 5 bits select the table entry and the 10 bits below interpolate between entries
+    uint8_t k = (v >> 10) & 0x1F;
+    uint16_t frac = v & 0x3FF;
+    uint16_t l = LOG2_LUT[k] + (uint16_t)(fx_mul_u16(LOG2_LUT[k + 1] - LOG2_LUT[k], frac) >> 10);
+
+    return (e << 12) + l;
+}
+
+// Filtered value with the background removed, at least 1
+static uint16_t above_background(uint16_t value, uint16_t background)
+{
+    return (value > background + 1) ? value - background : 1;
+}
+
+// 3-point parabolic interpolation
 // For a detailed description on the operation of this filter see: https://dspguru.com/dsp/howtos/how-to-interpolate-fft-peak/
-int16_t quadratic_middle(uint16_t *arr, char axis)
+// peak holds the filtered values at max_index-1, max_index and max_index+1
+static int16_t quadratic_offset(const uint16_t *peak, int16_t *d)
+{
+    // Get filtered values from around the peak
+    int16_t y1 = peak[0];
+    int16_t y2 = peak[1];
+    int16_t y3 = peak[2];
+
+    // Max value for d is 255*INTERVAL(3)*SCALE(8)/SUM(1) = 6120
+    // Perform a summation of the data
+    int16_t sum = 2*(2*y2 - y1 - y3);
+
+    // Handle division with 0
+    if(sum == 0) {
+        return DIVISION_ZERO;
+    }
+
+    // Calculate the location of the center bin and scale the result
+    *d = fx_sdiv((int32_t)(y3 - y1) * SCALE, sum);
+
+    return CALC_OK;
+}
+
+// 3-point parabolic interpolation of the logarithm, which is exact for a Gaussian spot
+// peak holds the filtered values at max_index-1, max_index and max_index+1
+static int16_t gaussian_offset(const uint16_t *peak, uint16_t background, int16_t *d)
+{
+    int32_t l1 = log2_q12(above_background(peak[0], background));
+    int32_t l2 = log2_q12(above_background(peak[1], background));
+    int32_t l3 = log2_q12(above_background(peak[2], background));
+
+    int32_t sum = 2*(2*l2 - l1 - l3);
+
+    // The logarithm of the maximum must be the largest
+    if (sum <= 0) {
+        return DIVISION_ZERO;
+    }
+
+    *d = fx_sdiv((l3 - l1) * SCALE, sum);
+
+    return CALC_OK;
+}
+
+// Least-squares parabola through the 5 filtered values from max_index-2 to max_index+2
+// The vertex of y = a + b*x + c*x^2 fitted at x = -2..2 is at -b/2c = -7*S1/(10*S2)
+static int16_t lsq5_offset(const uint16_t *peak, int16_t *d)
+{
+    int32_t s1 = 2*((int32_t)peak[4] - peak[0]) + ((int32_t)peak[3] - peak[1]);
+    int32_t s2 = 2*((int32_t)peak[0] + peak[4]) - peak[1] - 2*(int32_t)peak[2] - peak[3];
+
+    // A wide flat spot does not give a concave fit, use the 3 values at the top instead
+    if (s2 >= 0) {
+        return quadratic_offset(peak + 1, d);
+    }
+
+    int16_t offset = fx_sdiv(7 * s1 * SCALE, -10 * s2);
+
+    // Keep the result inside the fitted window
+    if (offset > 2*SCALE) offset = 2*SCALE;
+    else if (offset < -2*SCALE) offset = -2*SCALE;
+
+    *d = offset;
+
+    return CALC_OK;
+}
+
+// Filtered value at index i, computed from the raw profile like in rolling_filter()
+static uint16_t filtered_value(const uint8_t *arr, uint16_t i)
+{
+    uint16_t sum = arr[i];
+    if (i + 1 < 256) sum += arr[i + 1];
+    if (i + 2 < 256) sum += arr[i + 2];
+    return sum;
+}
+
+// Centroid of the filtered profile above the background. The window reaches CENTROID_HALF_WIDTH pixels
+// past the saturated region if there is one, otherwise past the maximum. Returns the center in SCALE units.
+static int16_t centroid_center(const FilterState *f, const uint8_t *arr, int16_t *center)
+{
+    uint16_t low = f->max_index;
+    uint16_t high = f->max_index;
+    uint16_t i;
+    uint32_t total_y = 0;
+
+    // high_index is the first index below the saturation level
+    if (f->low_index != 0) {
+        low = f->low_index;
+        high = (f->high_index < 255) ? f->high_index - 1 : 255;
+    }
+
+    low = (low > CENTROID_HALF_WIDTH) ? low - CENTROID_HALF_WIDTH : 0;
+    high = (high < 255 - CENTROID_HALF_WIDTH) ? high + CENTROID_HALF_WIDTH : 255;
+
+    fx_mac_clear();
+    for (i = low; i <= high; i++) {
+        uint16_t value = filtered_value(arr, i);
+        value = (value > f->min_value) ? value - f->min_value : 0;
+        fx_mac_u16(i, value);
+        total_y += value;
+    }
+
+    // Handle division with 0
+    if (total_y == 0) {
+        return DIVISION_ZERO;
+    }
+
+    // Round to the nearest SCALE step
+    *center = fx_udiv(fx_mac_read() * SCALE + total_y / 2, total_y);
+
+    return CALC_OK;
+}
+
+// Pick the estimator for EST_AUTO: the centroid for a saturated spot, the 5-point fit for a wide spot
+// which is still above 3/4 of its height 2 pixels from the maximum on average, otherwise the Gaussian fit
+static uint8_t auto_estimator(const FilterState *f)
+{
+    if (f->saturated) return EST_CENTROID;
+
+    // Heights above the background, 0 for a peak value below it (noisy baseline or an unfilled window)
+    uint16_t top = (f->peak[2] > f->min_value) ? f->peak[2] - f->min_value : 0;
+    uint16_t left = (f->peak[0] > f->min_value) ? f->peak[0] - f->min_value : 0;
+    uint16_t right = (f->peak[4] > f->min_value) ? f->peak[4] - f->min_value : 0;
+
+    return (2*((uint32_t)left + right) > 3*(uint32_t)top) ? EST_LSQ5 : EST_GAUSSIAN;
+}
+
+// Function used to estimate the center bin location with the estimator selected by ESTIMATOR
+// f is the finished filter pass and arr the raw profile it was run over
+int16_t estimate_middle(const FilterState *f, const uint8_t *arr, char axis)
 {
     // Calculate the appropriate SNR value and adjust for the INTERVAL summation from the rolling filter
     if (axis == 'x') {
-        SNR_X = (max_value - min_value)/INTERVAL;
+        SNR_X = fx_div_recip((uint16_t)(f->max_value - f->min_value), &INTERVAL_RECIP);
     }
     else if (axis == 'y') {
-        SNR_Y = (max_value - min_value)/INTERVAL;
+        SNR_Y = fx_div_recip((uint16_t)(f->max_value - f->min_value), &INTERVAL_RECIP);
     }
     else {
         // Axis was not defined --> return -1
@@ -228,30 +865,38 @@ int16_t quadratic_middle(uint16_t *arr, char axis)
     }
 
     // If the index of the maximum value is not in the specified range (I.E. the light spot is on the sensor edge), return -1
-    if ((max_index < SHIFT) || (max_index > (255-SHIFT))) {
+    if ((f->max_index < SHIFT) || (f->max_index > (255-SHIFT))) {
         return -1;
     }
 
-    // Get array values from around the peak
-    int16_t y1 = arr[max_index - 1];
-    int16_t y2 = arr[max_index];
-    int16_t y3 = arr[max_index + 1];
+    uint8_t estimator = ESTIMATOR;
+    if (estimator == EST_AUTO) estimator = auto_estimator(f);
 
-    // Max value for d is 255*INTERVAL(3)*SCALE(8)/SUM(1) = �6120
     int16_t d = 0;
+    int16_t center;
+    int16_t ret;
 
-    // Perform a summation of the data
-    int16_t sum = 2*(2*y2 - y1 - y3);
-
-    // Handle division with 0
-    if(sum == 0) {
-        return DIVISION_ZERO;
+    switch (estimator) {
+    case EST_GAUSSIAN:
+        ret = gaussian_offset(f->peak + 1, f->min_value, &d);
+        center = f->max_index * SCALE + d;
+        break;
+    case EST_LSQ5:
+        ret = lsq5_offset(f->peak, &d);
+        center = f->max_index * SCALE + d;
+        break;
+    case EST_CENTROID:
+        ret = centroid_center(f, arr, &center);
+        break;
+    default:
+        ret = quadratic_offset(f->peak + 1, &d);
+        center = f->max_index * SCALE + d;
+        break;
     }
 
-    // Calculate the location of the center bin and scale the result
-    d = ((y3 - y1) * SCALE) / sum;
-
-    int16_t center = max_index * SCALE + d;
+    if (ret != CALC_OK) {
+        return ret;
+    }
 
     // Return the corrected center bin calculation
     if (axis=='x') {
@@ -265,55 +910,112 @@ int16_t quadratic_middle(uint16_t *arr, char axis)
 }
 
 
-// This is the rolling filter, which filters the raw data. It also calculated the low, max and high indexes as well as the minimum and maximum values of the data
-uint8_t rolling_filter(const uint8_t *arr, uint16_t *filtered_arr){
-
-    // Helper variables
-    uint16_t sum = 0;
-    uint8_t ret = 0;
-    uint16_t i;
+// Start a new rolling filter pass
+void filter_reset(FilterState *f)
+{
+    f->i = 0;
+    f->sum = 0;
+    f->prev_sum = 0;
+    f->prev2_sum = 0;
+    f->saturated = 0;
+    f->peak_pending = 0;
+    f->peak[0] = f->peak[1] = f->peak[2] = f->peak[3] = f->peak[4] = 0;
 
     // Initialize all indexes to zero
-    low_index = 0;
-    high_index = 0;
-    max_index = 0;
+    f->low_index = 0;
+    f->high_index = 0;
+    f->max_index = 0;
 
     // The max and min values must be set to 1 and 65535 (max for a uint16_t variable).
-    max_value = 1;
-    min_value = 65535;
+    f->max_value = 1;
+    f->min_value = 65535;
+}
 
-    for(i = 0; i < 256 + SHIFT; i++){
+/*
+ * Advance the rolling filter over the first count pixels of arr. The pass can be fed in pieces while the DMA is still filling arr.
+ * The filtered profile is not stored. Only the filtered values around the current maximum are kept for the interpolation.
+ */
+void filter_feed(FilterState *f, const uint8_t *arr, uint16_t count)
+{
+    // Once all pixels are available, the filter can run past the end of the array
+    uint16_t end = (count >= 256) ? 256 + SHIFT : count;
+
+    // Work on local copies, the state is written back once at the end
+    uint16_t i = f->i;
+    uint16_t sum = f->sum;
+    uint16_t prev_sum = f->prev_sum;
+    uint16_t prev2_sum = f->prev2_sum;
+
+    for(; i < end; i++){
 
         if(i < 256) sum += arr[i];
 
         if(i >= INTERVAL) sum -= arr[i - INTERVAL];
 
         if(i >= SHIFT) {
-            // Add the summed variable to memory
-            filtered_arr[i - SHIFT] = sum;
+            // Complete the peak window with the values following a new maximum
+            if (f->peak_pending) {
+                f->peak[5 - f->peak_pending] = sum;
+                f->peak_pending--;
+            }
 
             // Save the low and high indexes of the data
-            if ((sum > SAT_LEVEL) && (low_index == 0)){
-                low_index = i-SHIFT;
+            if ((sum > SAT_LEVEL) && (f->low_index == 0)){
+                f->low_index = i-SHIFT;
 
-                // Set the return value to 1 to indicate a saturation event
-                ret = 1;
+                // Set the saturation flag
+                f->saturated = 1;
             }
-            else if ((sum < SAT_LEVEL) && (low_index != 0) && (high_index == 0)) high_index = i-SHIFT;
+            else if ((sum < SAT_LEVEL) && (f->low_index != 0) && (f->high_index == 0)) f->high_index = i-SHIFT;
 
             // Record the min and max values from the data
-            if ((sum < min_value) && (sum > 0)) min_value = sum;            // Check to see if the sum is larger than 0 to prevent division by zero
-            else if (sum > max_value){
-                max_value = sum;
-                max_index = i-SHIFT;
+            if ((sum < f->min_value) && (sum > 0)) f->min_value = sum;      // Check to see if the sum is larger than 0 to prevent division by zero
+            else if (sum > f->max_value){
+                f->max_value = sum;
+                f->max_index = i-SHIFT;
+
+                // Start a new peak window
+                f->peak[0] = prev2_sum;
+                f->peak[1] = prev_sum;
+                f->peak[2] = sum;
+                f->peak[3] = 0;
+                f->peak[4] = 0;
+                f->peak_pending = 2;
             }
+
+            prev2_sum = prev_sum;
+            prev_sum = sum;
         }
     }
 
+    f->i = i;
+    f->sum = sum;
+    f->prev_sum = prev_sum;
+    f->prev2_sum = prev2_sum;
+}
+
+// Finish the rolling filter pass and publish the indexes and min/max values for the middle calculations. Returns 1 on a saturation event.
+uint8_t filter_finish(FilterState *f)
+{
     // If the sensor is saturated in such a manner, that the saturation threshold isn't passed by the end of the array end - set high index to last element in array
-    if((low_index != 0) && (high_index == 0)) high_index = 255;
+    if((f->low_index != 0) && (f->high_index == 0)) f->high_index = 255;
+
+    low_index = f->low_index;
+    high_index = f->high_index;
+    max_index = f->max_index;
+    max_value = f->max_value;
+    min_value = f->min_value;
 
-    return ret;
+    return f->saturated;
+}
+
+// This is the rolling filter, which filters the raw data. It also calculated the low, max and high indexes as well as the minimum and maximum values of the data
+uint8_t rolling_filter(const uint8_t *arr, FilterState *f){
+
+    filter_reset(f);
+    filter_feed(f, arr, 256);
+
+    return filter_finish(f);
 }
 
 /*
@@ -333,325 +1035,196 @@ void ss_gain(uint8_t gain)
     }
 }
 
-#ifdef CALC_ANGLES
+/*
+ * Sun angle model. The arctangent is interpolated from knots of atan(k/64) for k = 0..64, which replaces the
+ * 2048-entry lookup table used before. calibration/angle_model.py generates the knots and checks the model against the old table.
+ */
+
+// Knots of atan(k/64) for k = 0..64 in 1/16 millidegrees
+static const uint32_t ATAN_KNOTS[65] = {
+         0,  14323,  28639,  42940,  57221,  71475,  85693,  99871,
+    114000, 128076, 142091, 156039, 169914, 183712, 197425, 211050,
+    224580, 238011, 251338, 264557, 277664, 290655, 303527, 316275,
+    328897, 341390, 353751, 365979, 378070, 390023, 401837, 413510,
+    425041, 436428, 447672, 458770, 469724, 480532, 491196, 501713,
+    512086, 522314, 532398, 542339, 552136, 561792, 571307, 580682,
+    589918, 599017, 607980, 616807, 625502, 634064, 642496, 650799,
+    658975, 667025, 674951, 682755, 690438, 698003, 705450, 712782,
+    720000,
+};
 
-uint16_t sat_calc_middle(uint16_t *arr, char axis)
+// Arctangent of num/den for 0 <= num <= den and 0 < den <= 0xFFFF in 1/16 millidegrees.
+// The value is interpolated with a parabola through the even knot below the ratio and the next two knots.
+static uint32_t atan_ratio(uint16_t num, uint16_t den)
 {
-    // Calculate the appropriate SNR value and adjust for the INTERVAL summation from the rolling filter
-    if (axis == 'x') {
-        SNR_X = (max_value - min_value)/INTERVAL;
-    }
-    else if (axis == 'y') {
-        SNR_Y = (max_value - min_value)/INTERVAL;
-    }
-    else {
-        return 0;
-    }
+    // Knot index and the position after it in Q15
+    uint32_t n = (uint32_t)num << 6;
+    uint16_t i = fx_udiv(n, den);
 
-    // Initialize variables
-    uint32_t total_xy = 0;
-    uint32_t total_y = 0;
-    unsigned int i;
+    if (i >= 64) return ATAN_KNOTS[64];
+
+    uint16_t t = fx_udiv((n - fx_mul_u16(i, den)) << 15, den);
+
+    // Position from the even knot in Q15, 0 <= s < 2
+    uint16_t k = i & ~1;
+    uint16_t s = ((i - k) << 15) + t;
 
-    // Calculate the mass totals - The indexes were calculated in rolling_average() so we can use them as limits automatically
-    for (i = low_index; i <= high_index; i++) {
-        total_xy = total_xy + i * arr[i];
-        total_y = total_y + arr[i];
+    // Newton form of the parabola through the three knots
+    uint32_t y0 = ATAN_KNOTS[k];
+    uint16_t d1 = ATAN_KNOTS[k + 1] - y0;
+    int16_t d2 = (int16_t)(ATAN_KNOTS[k + 2] - 2*ATAN_KNOTS[k + 1] + y0);
+    int16_t w = fx_mul_s16(s >> 1, (int16_t)(s - 32768)) >> 15;        // s*(s-1)/2
+
+    return y0 + (((int32_t)fx_mul_u16(s, d1) + fx_mul_s16(w, d2) + (1L << 14)) >> 15);
+}
+
+// Sun angle in millidegrees from the calibrated center bin (SCALE units, 1024 is the optical axis) and VALUE_Z.
+// Returns CALC_ERROR if the angle does not fit in 16 bits.
+uint8_t angle(int16_t middle, int16_t *out)
+{
+    uint32_t offset = (middle < 1024) ? 1024 - middle : middle - 1024;
+    uint32_t height = (uint32_t)VALUE_Z * SCALE;
+    uint32_t a;
+
+    *out = 0;
+    if (offset == 0) return CALC_OK;
+
+    // Keep the ratio in 16 bits
+    while (height > 0xFFFF) {
+        offset >>= 1;
+        height >>= 1;
     }
 
-    // Prevent division by zero error
-    if (total_xy == 0 || total_y == 0) return 0;
+    // Above 45 degrees use atan(x) = 90 - atan(1/x)
+    if (offset <= height) a = atan_ratio(offset, height);
+    else a = 90000UL * 16 - atan_ratio(height, offset);
 
-    // Compute the center bin
-    uint16_t ret = (total_xy) / (total_y);
+    int32_t angle_out = (a + 8) >> 4;
+    if (angle_out > 32767) return CALC_ERROR;
 
-    // Return the corrected center bin calculation
-    if (axis=='x') return (ret + X_BIAS);
-    else if (axis=='y') return (ret + Y_BIAS);
+    if (middle < 1024) angle_out = -angle_out;
 
-    // Axis was not defined --> return 0
-    return 0;
+    *out = angle_out;
+    return CALC_OK;
 }
 
-int16_t angle(uint16_t middle)
+/*
+ * Sun vector kernel. Two CORDIC vectoring passes give the azimuth and the elevation together with the length
+ * of the vector, which is then used to normalize the components.
+ */
+
+// Number of CORDIC iterations
+#define CORDIC_STEPS 16
+
+// atan(2^-i) in 1e-5 degrees
+static const int32_t CORDIC_ATAN[CORDIC_STEPS] = {
+    4500000, 2656505, 1403624, 712502, 357633, 178991, 89517, 44761,
+      22381,   11191,    5595,   2798,   1399,    699,   350,   175
+};
+
+// CORDIC gain K = 1.64676 of one vectoring pass in Q31 and 1/K^2 in Q32
+#define CORDIC_GAIN_Q31     3536390726UL
+#define CORDIC_INV_GAIN2    1583795506UL
+
+// CORDIC vectoring. Rotates (x, y) onto the positive x axis and returns the rotation in 1e-5 degrees.
+// x must be positive. K times the length of the vector is left in x.
+static int32_t cordic_vectoring(int32_t *x, int32_t *y)
 {
-    int sign = 0;
-    int16_t angle_out;
-    if(middle < 1024) middle = (1024 - middle);
-    else {
-        middle -= 1024;
-        sign = 1;
+    int32_t xi = *x, yi = *y, a = 0;
+    uint8_t i;
+
+    for (i = 0; i < CORDIC_STEPS; i++) {
+        int32_t dx = xi >> i;
+        int32_t dy = yi >> i;
+
+        if (yi >= 0) {
+            xi += dy;
+            yi -= dx;
+            a += CORDIC_ATAN[i];
+        }
+        else {
+            xi -= dy;
+            yi += dx;
+            a -= CORDIC_ATAN[i];
+        }
     }
-    middle = 2*middle;
-    angle_out = lt[middle];
 
-    if (!sign) angle_out = -angle_out;
+    *x = xi;
+    *y = yi;
+    return a;
+}
+
+// Angle in 1e-5 degrees to centidegrees, rounded to the nearest
+static int16_t centidegrees(int32_t a)
+{
+    return fx_sdiv(a + ((a < 0) ? -500 : 500), 1000);
+}
 
-    return angle_out;
+// Component in Q15 of a unit vector, |c| <= n
+static int16_t unit_component(int32_t c, const FxRecip *n)
+{
+    uint32_t q = fx_div_recip((uint32_t)((c < 0) ? -c : c) << 15, n);
+    if (q > 32767) q = 32767;
+    return (c < 0) ? -(int16_t)q : (int16_t)q;
 }
 
 /*
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-                    Lookup table
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-*/
+ * Unit sun vector, azimuth and elevation from the calibrated center bins of res and VALUE_Z.
+ * The components are relative to the optical axis (center bin 1024) like in angle().
+ */
+uint8_t sun_vector(const SensorResult *res, SunVector *v)
+{
+    int32_t x = (int32_t)res->value_x - 1024;
+    int32_t y = (int32_t)res->value_y - 1024;
+    int32_t z = (int32_t)VALUE_Z * SCALE;
+
+    if (x == 0 && y == 0 && z == 0) return CALC_ERROR;
+
+    // Scale the components up for the CORDIC precision, leaving room for the gain
+    uint32_t m = (uint32_t)((x < 0) ? -x : x) | (uint32_t)((y < 0) ? -y : y) | (uint32_t)z;
+    while (m < (1UL << 25)) {
+        m <<= 1;
+        x <<= 1;
+        y <<= 1;
+        z <<= 1;
+    }
 
-const uint16_t lt[LUT_SIZE] = {
-       0,   14,   28,   42,   56,   70,   84,   98,
-     112,  126,  140,  154,  168,  182,  196,  210,
-     224,  238,  252,  266,  280,  294,  308,  322,
-     336,  350,  364,  378,  392,  406,  420,  434,
-     448,  462,  476,  490,  504,  518,  532,  546,
-     560,  573,  587,  601,  615,  629,  643,  657,
-     671,  685,  699,  713,  727,  741,  755,  769,
-     783,  797,  811,  825,  839,  853,  867,  881,
-     895,  909,  923,  937,  951,  965,  979,  993,
-    1007, 1021, 1035, 1049, 1063, 1077, 1091, 1105,
-    1119, 1133, 1147, 1161, 1175, 1189, 1203, 1217,
-    1231, 1245, 1259, 1273, 1287, 1301, 1315, 1329,
-    1343, 1357, 1371, 1385, 1399, 1413, 1427, 1440,
-    1454, 1468, 1482, 1496, 1510, 1524, 1538, 1552,
-    1566, 1580, 1594, 1608, 1622, 1636, 1650, 1664,
-    1678, 1692, 1706, 1720, 1734, 1748, 1762, 1776,
-    1790, 1804, 1818, 1832, 1846, 1860, 1874, 1888,
-    1902, 1916, 1930, 1944, 1958, 1972, 1986, 2000,
-    2013, 2027, 2041, 2055, 2069, 2083, 2097, 2111,
-    2125, 2139, 2153, 2167, 2181, 2195, 2209, 2223,
-    2237, 2251, 2265, 2279, 2293, 2307, 2321, 2335,
-    2349, 2363, 2377, 2391, 2405, 2419, 2432, 2446,
-    2460, 2474, 2488, 2502, 2516, 2530, 2544, 2558,
-    2572, 2586, 2600, 2614, 2628, 2642, 2656, 2670,
-    2684, 2698, 2712, 2726, 2740, 2754, 2768, 2781,
-    2795, 2809, 2823, 2837, 2851, 2865, 2879, 2893,
-    2907, 2921, 2935, 2949, 2963, 2977, 2991, 3005,
-    3019, 3033, 3047, 3061, 3074, 3088, 3102, 3116,
-    3130, 3144, 3158, 3172, 3186, 3200, 3214, 3228,
-    3242, 3256, 3270, 3284, 3298, 3312, 3325, 3339,
-    3353, 3367, 3381, 3395, 3409, 3423, 3437, 3451,
-    3465, 3479, 3493, 3507, 3521, 3535, 3548, 3562,
-    3576, 3590, 3604, 3618, 3632, 3646, 3660, 3674,
-    3688, 3702, 3716, 3730, 3744, 3757, 3771, 3785,
-    3799, 3813, 3827, 3841, 3855, 3869, 3883, 3897,
-    3911, 3925, 3938, 3952, 3966, 3980, 3994, 4008,
-    4022, 4036, 4050, 4064, 4078, 4092, 4105, 4119,
-    4133, 4147, 4161, 4175, 4189, 4203, 4217, 4231,
-    4245, 4259, 4272, 4286, 4300, 4314, 4328, 4342,
-    4356, 4370, 4384, 4398, 4412, 4425, 4439, 4453,
-    4467, 4481, 4495, 4509, 4523, 4537, 4551, 4564,
-    4578, 4592, 4606, 4620, 4634, 4648, 4662, 4676,
-    4690, 4703, 4717, 4731, 4745, 4759, 4773, 4787,
-    4801, 4815, 4828, 4842, 4856, 4870, 4884, 4898,
-    4912, 4926, 4940, 4953, 4967, 4981, 4995, 5009,
-    5023, 5037, 5051, 5064, 5078, 5092, 5106, 5120,
-    5134, 5148, 5162, 5176, 5189, 5203, 5217, 5231,
-    5245, 5259, 5273, 5286, 5300, 5314, 5328, 5342,
-    5356, 5370, 5384, 5397, 5411, 5425, 5439, 5453,
-    5467, 5481, 5494, 5508, 5522, 5536, 5550, 5564,
-    5578, 5591, 5605, 5619, 5633, 5647, 5661, 5675,
-    5688, 5702, 5716, 5730, 5744, 5758, 5772, 5785,
-    5799, 5813, 5827, 5841, 5855, 5868, 5882, 5896,
-    5910, 5924, 5938, 5951, 5965, 5979, 5993, 6007,
-    6021, 6034, 6048, 6062, 6076, 6090, 6104, 6117,
-    6131, 6145, 6159, 6173, 6187, 6200, 6214, 6228,
-    6242, 6256, 6270, 6283, 6297, 6311, 6325, 6339,
-    6352, 6366, 6380, 6394, 6408, 6422, 6435, 6449,
-    6463, 6477, 6491, 6504, 6518, 6532, 6546, 6560,
-    6573, 6587, 6601, 6615, 6629, 6642, 6656, 6670,
-    6684, 6698, 6711, 6725, 6739, 6753, 6767, 6780,
-    6794, 6808, 6822, 6836, 6849, 6863, 6877, 6891,
-    6905, 6918, 6932, 6946, 6960, 6973, 6987, 7001,
-    7015, 7029, 7042, 7056, 7070, 7084, 7097, 7111,
-    7125, 7139, 7153, 7166, 7180, 7194, 7208, 7221,
-    7235, 7249, 7263, 7276, 7290, 7304, 7318, 7332,
-    7345, 7359, 7373, 7387, 7400, 7414, 7428, 7442,
-    7455, 7469, 7483, 7497, 7510, 7524, 7538, 7552,
-    7565, 7579, 7593, 7607, 7620, 7634, 7648, 7662,
-    7675, 7689, 7703, 7716, 7730, 7744, 7758, 7771,
-    7785, 7799, 7813, 7826, 7840, 7854, 7868, 7881,
-    7895, 7909, 7922, 7936, 7950, 7964, 7977, 7991,
-    8005, 8018, 8032, 8046, 8060, 8073, 8087, 8101,
-    8114, 8128, 8142, 8156, 8169, 8183, 8197, 8210,
-    8224, 8238, 8251, 8265, 8279, 8293, 8306, 8320,
-    8334, 8347, 8361, 8375, 8388, 8402, 8416, 8430,
-    8443, 8457, 8471, 8484, 8498, 8512, 8525, 8539,
-    8553, 8566, 8580, 8594, 8607, 8621, 8635, 8648,
-    8662, 8676, 8689, 8703, 8717, 8730, 8744, 8758,
-    8771, 8785, 8799, 8812, 8826, 8840, 8853, 8867,
-    8881, 8894, 8908, 8922, 8935, 8949, 8963, 8976,
-    8990, 9004, 9017, 9031, 9044, 9058, 9072, 9085,
-    9099, 9113, 9126, 9140, 9154, 9167, 9181, 9194,
-    9208, 9222, 9235, 9249, 9263, 9276, 9290, 9303,
-    9317, 9331, 9344, 9358, 9372, 9385, 9399, 9412,
-    9426, 9440, 9453, 9467, 9480, 9494, 9508, 9521,
-    9535, 9548, 9562, 9576, 9589, 9603, 9617, 9630,
-    9644, 9657, 9671, 9684, 9698, 9712, 9725, 9739,
-    9752, 9766, 9780, 9793, 9807, 9820, 9834, 9848,
-    9861, 9875, 9888, 9902, 9915, 9929, 9943, 9956,
-    9970, 9983, 9997, 10010, 10024, 10038, 10051, 10065,
-    10078, 10092, 10105, 10119, 10132, 10146, 10160, 10173,
-    10187, 10200, 10214, 10227, 10241, 10254, 10268, 10281,
-    10295, 10309, 10322, 10336, 10349, 10363, 10376, 10390,
-    10403, 10417, 10430, 10444, 10457, 10471, 10484, 10498,
-    10512, 10525, 10539, 10552, 10566, 10579, 10593, 10606,
-    10620, 10633, 10647, 10660, 10674, 10687, 10701, 10714,
-    10728, 10741, 10755, 10768, 10782, 10795, 10809, 10822,
-    10836, 10849, 10863, 10876, 10890, 10903, 10917, 10930,
-    10944, 10957, 10971, 10984, 10998, 11011, 11025, 11038,
-    11051, 11065, 11078, 11092, 11105, 11119, 11132, 11146,
-    11159, 11173, 11186, 11200, 11213, 11227, 11240, 11253,
-    11267, 11280, 11294, 11307, 11321, 11334, 11348, 11361,
-    11374, 11388, 11401, 11415, 11428, 11442, 11455, 11469,
-    11482, 11495, 11509, 11522, 11536, 11549, 11563, 11576,
-    11589, 11603, 11616, 11630, 11643, 11657, 11670, 11683,
-    11697, 11710, 11724, 11737, 11750, 11764, 11777, 11791,
-    11804, 11817, 11831, 11844, 11858, 11871, 11884, 11898,
-    11911, 11925, 11938, 11951, 11965, 11978, 11992, 12005,
-    12018, 12032, 12045, 12058, 12072, 12085, 12099, 12112,
-    12125, 12139, 12152, 12165, 12179, 12192, 12206, 12219,
-    12232, 12246, 12259, 12272, 12286, 12299, 12312, 12326,
-    12339, 12352, 12366, 12379, 12392, 12406, 12419, 12432,
-    12446, 12459, 12473, 12486, 12499, 12513, 12526, 12539,
-    12553, 12566, 12579, 12592, 12606, 12619, 12632, 12646,
-    12659, 12672, 12686, 12699, 12712, 12726, 12739, 12752,
-    12766, 12779, 12792, 12805, 12819, 12832, 12845, 12859,
-    12872, 12885, 12899, 12912, 12925, 12938, 12952, 12965,
-    12978, 12992, 13005, 13018, 13031, 13045, 13058, 13071,
-    13084, 13098, 13111, 13124, 13138, 13151, 13164, 13177,
-    13191, 13204, 13217, 13230, 13244, 13257, 13270, 13283,
-    13297, 13310, 13323, 13336, 13350, 13363, 13376, 13389,
-    13403, 13416, 13429, 13442, 13456, 13469, 13482, 13495,
-    13508, 13522, 13535, 13548, 13561, 13575, 13588, 13601,
-    13614, 13627, 13641, 13654, 13667, 13680, 13693, 13707,
-    13720, 13733, 13746, 13759, 13773, 13786, 13799, 13812,
-    13825, 13839, 13852, 13865, 13878, 13891, 13905, 13918,
-    13931, 13944, 13957, 13970, 13984, 13997, 14010, 14023,
-    14036, 14049, 14063, 14076, 14089, 14102, 14115, 14128,
-    14142, 14155, 14168, 14181, 14194, 14207, 14220, 14234,
-    14247, 14260, 14273, 14286, 14299, 14312, 14326, 14339,
-    14352, 14365, 14378, 14391, 14404, 14417, 14431, 14444,
-    14457, 14470, 14483, 14496, 14509, 14522, 14535, 14549,
-    14562, 14575, 14588, 14601, 14614, 14627, 14640, 14653,
-    14666, 14680, 14693, 14706, 14719, 14732, 14745, 14758,
-    14771, 14784, 14797, 14810, 14823, 14836, 14850, 14863,
-    14876, 14889, 14902, 14915, 14928, 14941, 14954, 14967,
-    14980, 14993, 15006, 15019, 15032, 15045, 15058, 15071,
-    15085, 15098, 15111, 15124, 15137, 15150, 15163, 15176,
-    15189, 15202, 15215, 15228, 15241, 15254, 15267, 15280,
-    15293, 15306, 15319, 15332, 15345, 15358, 15371, 15384,
-    15397, 15410, 15423, 15436, 15449, 15462, 15475, 15488,
-    15501, 15514, 15527, 15540, 15553, 15566, 15579, 15592,
-    15605, 15618, 15631, 15644, 15657, 15670, 15683, 15696,
-    15709, 15722, 15735, 15748, 15760, 15773, 15786, 15799,
-    15812, 15825, 15838, 15851, 15864, 15877, 15890, 15903,
-    15916, 15929, 15942, 15955, 15968, 15980, 15993, 16006,
-    16019, 16032, 16045, 16058, 16071, 16084, 16097, 16110,
-    16123, 16136, 16148, 16161, 16174, 16187, 16200, 16213,
-    16226, 16239, 16252, 16265, 16277, 16290, 16303, 16316,
-    16329, 16342, 16355, 16368, 16380, 16393, 16406, 16419,
-    16432, 16445, 16458, 16471, 16483, 16496, 16509, 16522,
-    16535, 16548, 16561, 16573, 16586, 16599, 16612, 16625,
-    16638, 16650, 16663, 16676, 16689, 16702, 16715, 16727,
-    16740, 16753, 16766, 16779, 16792, 16804, 16817, 16830,
-    16843, 16856, 16868, 16881, 16894, 16907, 16920, 16933,
-    16945, 16958, 16971, 16984, 16997, 17009, 17022, 17035,
-    17048, 17060, 17073, 17086, 17099, 17112, 17124, 17137,
-    17150, 17163, 17175, 17188, 17201, 17214, 17226, 17239,
-    17252, 17265, 17278, 17290, 17303, 17316, 17329, 17341,
-    17354, 17367, 17380, 17392, 17405, 17418, 17430, 17443,
-    17456, 17469, 17481, 17494, 17507, 17520, 17532, 17545,
-    17558, 17570, 17583, 17596, 17609, 17621, 17634, 17647,
-    17659, 17672, 17685, 17697, 17710, 17723, 17736, 17748,
-    17761, 17774, 17786, 17799, 17812, 17824, 17837, 17850,
-    17862, 17875, 17888, 17900, 17913, 17926, 17938, 17951,
-    17964, 17976, 17989, 18002, 18014, 18027, 18040, 18052,
-    18065, 18078, 18090, 18103, 18115, 18128, 18141, 18153,
-    18166, 18179, 18191, 18204, 18216, 18229, 18242, 18254,
-    18267, 18280, 18292, 18305, 18317, 18330, 18343, 18355,
-    18368, 18380, 18393, 18406, 18418, 18431, 18443, 18456,
-    18469, 18481, 18494, 18506, 18519, 18531, 18544, 18557,
-    18569, 18582, 18594, 18607, 18619, 18632, 18645, 18657,
-    18670, 18682, 18695, 18707, 18720, 18732, 18745, 18757,
-    18770, 18783, 18795, 18808, 18820, 18833, 18845, 18858,
-    18870, 18883, 18895, 18908, 18920, 18933, 18945, 18958,
-    18970, 18983, 18995, 19008, 19020, 19033, 19045, 19058,
-    19070, 19083, 19095, 19108, 19120, 19133, 19145, 19158,
-    19170, 19183, 19195, 19208, 19220, 19233, 19245, 19258,
-    19270, 19283, 19295, 19307, 19320, 19332, 19345, 19357,
-    19370, 19382, 19395, 19407, 19420, 19432, 19444, 19457,
-    19469, 19482, 19494, 19507, 19519, 19531, 19544, 19556,
-    19569, 19581, 19594, 19606, 19618, 19631, 19643, 19656,
-    19668, 19680, 19693, 19705, 19718, 19730, 19742, 19755,
-    19767, 19780, 19792, 19804, 19817, 19829, 19841, 19854,
-    19866, 19879, 19891, 19903, 19916, 19928, 19940, 19953,
-    19965, 19977, 19990, 20002, 20015, 20027, 20039, 20052,
-    20064, 20076, 20089, 20101, 20113, 20126, 20138, 20150,
-    20163, 20175, 20187, 20200, 20212, 20224, 20237, 20249,
-    20261, 20273, 20286, 20298, 20310, 20323, 20335, 20347,
-    20360, 20372, 20384, 20396, 20409, 20421, 20433, 20446,
-    20458, 20470, 20482, 20495, 20507, 20519, 20532, 20544,
-    20556, 20568, 20581, 20593, 20605, 20617, 20630, 20642,
-    20654, 20666, 20679, 20691, 20703, 20715, 20728, 20740,
-    20752, 20764, 20776, 20789, 20801, 20813, 20825, 20838,
-    20850, 20862, 20874, 20886, 20899, 20911, 20923, 20935,
-    20947, 20960, 20972, 20984, 20996, 21008, 21021, 21033,
-    21045, 21057, 21069, 21082, 21094, 21106, 21118, 21130,
-    21142, 21155, 21167, 21179, 21191, 21203, 21215, 21228,
-    21240, 21252, 21264, 21276, 21288, 21300, 21313, 21325,
-    21337, 21349, 21361, 21373, 21385, 21398, 21410, 21422,
-    21434, 21446, 21458, 21470, 21482, 21494, 21507, 21519,
-    21531, 21543, 21555, 21567, 21579, 21591, 21603, 21615,
-    21628, 21640, 21652, 21664, 21676, 21688, 21700, 21712,
-    21724, 21736, 21748, 21760, 21772, 21785, 21797, 21809,
-    21821, 21833, 21845, 21857, 21869, 21881, 21893, 21905,
-    21917, 21929, 21941, 21953, 21965, 21977, 21989, 22001,
-    22013, 22025, 22037, 22049, 22061, 22073, 22085, 22097,
-    22109, 22121, 22133, 22145, 22157, 22169, 22181, 22193,
-    22205, 22217, 22229, 22241, 22253, 22265, 22277, 22289,
-    22301, 22313, 22325, 22337, 22349, 22361, 22373, 22385,
-    22397, 22409, 22421, 22433, 22445, 22457, 22469, 22481,
-    22493, 22505, 22516, 22528, 22540, 22552, 22564, 22576,
-    22588, 22600, 22612, 22624, 22636, 22648, 22660, 22671,
-    22683, 22695, 22707, 22719, 22731, 22743, 22755, 22767,
-    22779, 22790, 22802, 22814, 22826, 22838, 22850, 22862,
-    22874, 22886, 22897, 22909, 22921, 22933, 22945, 22957,
-    22969, 22980, 22992, 23004, 23016, 23028, 23040, 23052,
-    23063, 23075, 23087, 23099, 23111, 23123, 23134, 23146,
-    23158, 23170, 23182, 23194, 23205, 23217, 23229, 23241,
-    23253, 23264, 23276, 23288, 23300, 23312, 23323, 23335,
-    23347, 23359, 23371, 23382, 23394, 23406, 23418, 23429,
-    23441, 23453, 23465, 23477, 23488, 23500, 23512, 23524,
-    23535, 23547, 23559, 23571, 23582, 23594, 23606, 23618,
-    23629, 23641, 23653, 23665, 23676, 23688, 23700, 23712,
-    23723, 23735, 23747, 23758, 23770, 23782, 23794, 23805,
-    23817, 23829, 23840, 23852, 23864, 23875, 23887, 23899,
-    23911, 23922, 23934, 23946, 23957, 23969, 23981, 23992,
-    24004, 24016, 24027, 24039, 24051, 24062, 24074, 24086,
-    24097, 24109, 24121, 24132, 24144, 24156, 24167, 24179,
-    24191, 24202, 24214, 24225, 24237, 24249, 24260, 24272,
-    24284, 24295, 24307, 24318, 24330, 24342, 24353, 24365,
-    24376, 24388, 24400, 24411, 24423, 24434, 24446, 24458,
-    24469, 24481, 24492, 24504, 24516, 24527, 24539, 24550,
-    24562, 24573, 24585, 24597, 24608, 24620, 24631, 24643,
-    24654, 24666, 24677, 24689, 24701, 24712, 24724, 24735,
-    24747, 24758, 24770, 24781, 24793, 24804, 24816, 24827,
-    24839, 24850, 24862, 24874, 24885, 24897, 24908, 24920,
-    24931, 24943, 24954, 24966, 24977, 24989, 25000, 25012,
-    25023, 25035, 25046, 25057, 25069, 25080, 25092, 25103,
-    25115, 25126, 25138, 25149, 25161, 25172, 25184, 25195,
-    25207, 25218, 25229, 25241, 25252, 25264, 25275, 25287,
-    25298, 25309, 25321, 25332, 25344, 25355, 25367, 25378,
-    25389, 25401, 25412, 25424, 25435, 25447, 25458, 25469,
-    25481, 25492, 25504, 25515, 25526, 25538, 25549, 25560,
-    25572, 25583, 25595, 25606, 25617, 25629, 25640, 25651,
-    25663, 25674, 25686, 25697, 25708, 25720, 25731, 25742,
-    25754, 25765, 25776, 25788, 25799, 25810, 25822, 25833,
-    25844, 25856, 25867, 25878, 25890, 25901, 25912, 25924,
-    25935, 25946, 25958, 25969, 25980, 25991, 26003, 26014,
-    26025, 26037, 26048, 26059, 26071, 26082, 26093, 26104,
-    26116, 26127, 26138, 26150, 26161, 26172, 26183, 26195,
-    26206, 26217, 26228, 26240, 26251, 26262, 26273, 26285,
-    26296, 26307, 26318, 26330, 26341, 26352, 26363, 26374,
-    26386, 26397, 26408, 26419, 26431, 26442, 26453, 26464,
-    26475, 26487, 26498, 26509, 26520, 26531, 26543, 26554
-};
-#endif
+    // Azimuth in the plane of the sensor. Move the left half plane to the right before the rotation.
+    int32_t rx = (x < 0) ? -x : x;
+    int32_t ry = (x < 0) ? -y : y;
+    int32_t azimuth = 0;
+
+    if (rx != 0 || ry != 0) {
+        azimuth = cordic_vectoring(&rx, &ry);
+        if (x < 0) {
+            azimuth += 18000000;
+            if (azimuth > 18000000) azimuth -= 36000000;
+        }
+    }
+
+    // Elevation from the plane of the sensor. rx holds K*|(x, y)|, so z is scaled by K as well.
+    int32_t ez = fx_mul32_hi(z, CORDIC_GAIN_Q31) << 1;
+    int32_t elevation = cordic_vectoring(&rx, &ez);
+
+    // Length of the vector without the gain of the two passes
+    uint32_t n = fx_mul32_hi(rx, CORDIC_INV_GAIN2);
+
+    // Normalize in 16 bits
+    while (n > 0xFFFF) {
+        n >>= 1;
+        x >>= 1;
+        y >>= 1;
+        z >>= 1;
+    }
+
+    FxRecip recip;
+    fx_recip_init(&recip, n);
+
+    v->x = unit_component(x, &recip);
+    v->y = unit_component(y, &recip);
+    v->z = unit_component(z, &recip);
+    v->azimuth = centidegrees(azimuth);
+    v->elevation = centidegrees(elevation);
+
+    return CALC_OK;
+}
@@ -3,31 +3,113 @@
 
 #include <stdint.h>
 #include "main.h"
+#include "platform/timestamp.h"
 #define FRAM_VAR __attribute__((section(".fram_vars")))
 
 
 // Values and Constants
-#define LUT_SIZE 2048
+#define CENTER_SCALE        8       // The center bins are in 1/8 pixels, 1024 is the optical axis
 
+// Accepted pinhole heights (VALUE_Z) in pixels. The height in center bin units must fit in 16 bits.
+// Below about 199 pixels the edges of the sensor are past the 32.767 degrees angle() can return.
+#define VALUE_Z_MIN         16
+#define VALUE_Z_MAX         (0xFFFF / CENTER_SCALE)
 #define CALC_OK             0x01
 #define DIVISION_ZERO       0x02
+#define CALC_ERROR          0x03
+#define SAMPLING_ERROR      0x04
+
+// Acquisition modes
+#define ACQ_MODE_SINGLE     0x00    // Sensor is read out only when a command requests a sample
+#define ACQ_MODE_CONTINUOUS 0x01    // Sensor is read out every cycle and frames are processed on the background
+#define ACQ_MODE_STREAMING  0x02    // Filter the profiles while the DMA is still reading them out (single mode)
+
+// Triggered measurement states
+#define TRIGGER_DONE        0x00    // The result is available
+#define TRIGGER_PENDING     0x01    // The frame has not been processed yet
+#define TRIGGER_UNKNOWN     0x02    // The ticket is not the latest trigger
+
+// Sub-pixel estimators
+#define EST_QUADRATIC       0x00    // 3-point parabolic interpolation
+#define EST_GAUSSIAN        0x01    // 3-point log-parabola (Gaussian) fit
+#define EST_LSQ5            0x02    // 5-point least-squares parabola
+#define EST_CENTROID        0x03    // Windowed centroid, over the saturated region if there is one
+#define EST_AUTO            0x04    // Centroid when saturated, otherwise Gaussian for narrow and 5-point for wide spots
+
+// Processed result of one sensor frame
+typedef struct {
+    int16_t value_x, value_y;
+    uint16_t snr_x, snr_y;
+    uint8_t peak_x, peak_y;         // Pixel index of the maximum of the filtered profiles
+    uint16_t frame;                 // Running frame counter
+    timestamp_t timestamp;          // Time when the readout of the frame completed
+    uint8_t status;                 // CALC_OK, CALC_ERROR or SAMPLING_ERROR
+} SensorResult;
+
+// Sun vector computed from a SensorResult
+typedef struct {
+    int16_t x, y, z;                // Unit vector in Q15
+    int16_t azimuth;                // Direction in the plane of the sensor, atan2(y, x) in centidegrees
+    int16_t elevation;              // Angle from the plane of the sensor in centidegrees, 9000 on the optical axis
+} SunVector;
+
+// Measurement pipeline counters
+typedef struct {
+    uint32_t dma_timeouts;          // Readouts which timed out
+    uint32_t sampling_errors;       // Measurements lost to a failed readout
+    uint32_t calc_errors;           // Frames the position could not be estimated from
+} PipelineStats;
+
+// State of a rolling filter pass, which can be fed incrementally
+typedef struct {
+    uint16_t i;                     // Next filter step
+    uint16_t sum, prev_sum, prev2_sum;
+    uint16_t max_value, min_value;
+    uint16_t peak[5];               // Filtered values from max_index-2 to max_index+2
+    uint8_t low_index, high_index, max_index;
+    uint8_t saturated;
+    uint8_t peak_pending;           // Number of values after the maximum still to be filled into peak
+} FilterState;
+
+// Raw frame captured in a burst
+typedef struct {
+    uint16_t frame;                 // Running frame counter
+    uint16_t cycle;                 // Sensor cycle of the frame. A gap means cycles were not read out.
+    timestamp_t timestamp;          // Time when the readout of the frame completed
+    uint16_t int_time;              // INT_TIME and GAIN of the frame
+    uint8_t gain;
+    uint8_t reserved;
+    uint8_t x[256];
+    uint8_t y[256];
+} BurstFrame;
+
+/*
+ * Frames in the burst buffer. A frame takes 522 bytes of the 16 KB of FRAM, which is
+ * shared with the code and the FRAM_VARS region, so only a few fit. The linker places
+ * the buffer after the code and fails if it does not fit. It can be raised as long as
+ * the firmware links, the map file shows the room left.
+ */
+#define BURST_FRAMES        4
 
 #pragma SET_DATA_SECTION(".fram_vars")
 extern int16_t X_BIAS;              // This value is multiplied by 8, to compensate for the scaling factor SCALE (13)
 extern int16_t Y_BIAS;              // This value is multiplied by 8, to compensate for the scaling factor SCALE (20.6*8 = 165)
-extern uint16_t VALUE_Z;            // This is the height of the pinhole scaled to the same size of the sensor
+extern uint16_t VALUE_Z;            // This is the height of the pinhole scaled to the same size of the sensor (in pixels)
 extern int16_t TEMPERATURE_BIAS;     // Temperature BIAS in deciDegC
 
 extern uint16_t INT_TIME;
 extern uint16_t SAMPLING_TIME;
 extern uint16_t SAT_LEVEL;
 extern uint8_t GAIN;
+extern uint8_t ACQ_MODE;
+extern uint8_t ESTIMATOR;
 #pragma SET_DATA_SECTION()
 
 // Variables
 extern volatile int ind;
-extern uint8_t x_data[256];
-extern uint8_t y_data[256];
+// Raw profiles of the latest completed frame
+extern uint8_t *x_data;
+extern uint8_t *y_data;
 extern uint16_t SNR_X, SNR_Y;
 extern int16_t VALUE_X;
 extern int16_t VALUE_Y;
@@ -35,30 +117,59 @@ extern int16_t VALUE_Y;
 
 extern volatile uint8_t dataRequested;
 
+// Result of the latest processed frame
+extern SensorResult last_result;
+
+extern PipelineStats pipeline_stats;
+
 // Functions
 // sample sensor
 int SAMPLE_SENSOR(void);
+// Filter and interpolate the latest completed frame (x_data/y_data) into res
+uint8_t process_frame(SensorResult *res);
+// Sample the sensor and process the frame into res, returns 0 on sampling error
+int sample_and_process(SensorResult *res);
+// Background acquisition task, called from the main loop
+void acquisition_process(void);
+// Returns non-zero if a completed frame is waiting for acquisition_process()
+int acquisition_pending(void);
+// Abort an ongoing readout and forget the latest result
+void acquisition_reset(void);
+// Start a background measurement of the next frame, returns its ticket
+uint16_t acquisition_trigger(void);
+// Get the result of a triggered measurement, returns TRIGGER_DONE, TRIGGER_PENDING or TRIGGER_UNKNOWN
+uint8_t acquisition_fetch(uint16_t ticket, SensorResult *res);
+// Time in ms until the triggered measurement should be done at the latest
+uint16_t acquisition_eta(void);
+// Capture the next count frames into the burst buffer, also in single acquisition mode
+void burst_start(uint8_t count);
+// Frame i of the latest burst, NULL if it has not been captured
+const BurstFrame* burst_frame(uint8_t i);
+// Number of frames requested in the latest burst
+uint8_t burst_length(void);
+// Time in ms until frame i of the burst should be captured at the latest, 0 if the burst has stopped
+uint16_t burst_eta(uint8_t i);
+// Restart the sampling sequence for a synchronous trigger, called from the bus receive interrupt
+void acquisition_sync(uint16_t id);
 // sends start signals continuously to the sensor
 void ST_SIGNAL_ENABLE(void);
 // stops sending signals to sensor
 // NO SAMPLING
 void ST_SIGNAL_DISABLE(void);
 
-// Function used to estimate the center bin location through interpolation
-int16_t quadratic_middle(uint16_t *arr, char axis);
+// Estimate the center bin location from a finished filter pass over the raw profile arr
+int16_t estimate_middle(const FilterState *f, const uint8_t *arr, char axis);
 // This is the rolling filter, which filters the raw data
-uint8_t rolling_filter(const uint8_t *arr, uint16_t *filtered_arr);
+uint8_t rolling_filter(const uint8_t *arr, FilterState *f);
+// Incremental rolling filter
+void filter_reset(FilterState *f);
+void filter_feed(FilterState *f, const uint8_t *arr, uint16_t count);
+uint8_t filter_finish(FilterState *f);
 //Set sensor gains
 void ss_gain(uint8_t gain);
-
-// Requires a lot of memory!
-#ifdef CALC_ANGLES
-extern const uint16_t lt[LUT_SIZE];
-// calculate saturation middle
-uint16_t sat_calc_middle(uint16_t *arr, char axis);
-// calculate sun angle
-// Requires a lot of memory!
-int16_t angle(uint16_t middle);
-#endif
+// calculate sun angle in millidegrees from a calibrated center bin, returns CALC_OK or CALC_ERROR
+uint8_t angle(int16_t middle, int16_t *out);
+// calculate the unit sun vector and its azimuth and elevation, returns CALC_OK or CALC_ERROR
+uint8_t sun_vector(const SensorResult *res, SunVector *v);
 
 #endif /* CALC_H */
@@ -0,0 +1,165 @@
+#include "fixmath.h"
+
+#include <msp430.h>
+
+#ifdef __MSP430_HAS_MPY32__
+// Results are ready 3 (16x16) or 7 (32x32) cycles after writing the second operand
+#define MPY16_WAIT() __delay_cycles(3)
+#define MPY32_WAIT() __delay_cycles(7)
+#endif
+
+uint32_t fx_mul_u16(uint16_t a, uint16_t b)
+{
+#ifdef __MSP430_HAS_MPY32__
+    MPY = a;
+    OP2 = b;
+    MPY16_WAIT();
+    return ((uint32_t)RESHI << 16) | RESLO;
+#else
+    return (uint32_t)a * b;
+#endif
+}
+
+int32_t fx_mul_s16(int16_t a, int16_t b)
+{
+#ifdef __MSP430_HAS_MPY32__
+    MPYS = a;
+    OP2 = b;
+    MPY16_WAIT();
+    return (int32_t)(((uint32_t)RESHI << 16) | RESLO);
+#else
+    return (int32_t)a * b;
+#endif
+}
+
+// Upper 32 bits of the 64-bit product
+uint32_t fx_mul32_hi(uint32_t a, uint32_t b)
+{
+#ifdef __MSP430_HAS_MPY32__
+    MPY32L = (uint16_t)a;
+    MPY32H = (uint16_t)(a >> 16);
+    OP2L = (uint16_t)b;
+    OP2H = (uint16_t)(b >> 16);
+    MPY32_WAIT();
+    return ((uint32_t)RES3 << 16) | RES2;
+#else
+    return (uint32_t)(((uint64_t)a * b) >> 32);
+#endif
+}
+
+#ifndef __MSP430_HAS_MPY32__
+static uint32_t mac_acc;
+#endif
+
+void fx_mac_clear(void)
+{
+#ifdef __MSP430_HAS_MPY32__
+    RESLO = 0;
+    RESHI = 0;
+#else
+    mac_acc = 0;
+#endif
+}
+
+void fx_mac_u16(uint16_t a, uint16_t b)
+{
+#ifdef __MSP430_HAS_MPY32__
+    MAC = a;
+    OP2 = b;
+#else
+    mac_acc += (uint32_t)a * b;
+#endif
+}
+
+uint32_t fx_mac_read(void)
+{
+#ifdef __MSP430_HAS_MPY32__
+    MPY16_WAIT();
+    return ((uint32_t)RESHI << 16) | RESLO;
+#else
+    return mac_acc;
+#endif
+}
+
+int16_t fx_sat16(int32_t x)
+{
+    if (x > INT16_MAX) return INT16_MAX;
+    if (x < INT16_MIN) return INT16_MIN;
+    return (int16_t)x;
+}
+
+int16_t fx_add_sat16(int16_t a, int16_t b)
+{
+    return fx_sat16((int32_t)a + b);
+}
+
+void fx_recip_init(FxRecip *r, uint32_t d)
+{
+    r->d = d;
+    r->m = 0xFFFFFFFFUL / d;
+}
+
+uint32_t fx_div_recip(uint32_t n, const FxRecip *r)
+{
+    // The estimate is the quotient or one less
+    uint32_t q = fx_mul32_hi(n, r->m);
+    if (n - q * r->d >= r->d) q++;
+    return q;
+}
+
+/*
+ * Approximate 2^31 / d for d in [2^15, 2^16).
+ * Linear initial estimate followed by two Newton-Raphson iterations x = x * (2 - d * x).
+ */
+static uint32_t recip_norm(uint16_t d)
+{
+    // x0 = 48/17 - 32/17 * d in Q15, with d scaled to [0.5, 1)
+    uint32_t x = 92521UL - (fx_mul_u16(d, 61681) >> 16);
+    uint8_t i;
+
+    for (i = 0; i < 2; i++) {
+        // 2 - d * x in Q31
+        uint32_t e = 0 - fx_mul_u16(d, (uint16_t)(x > 0xFFFF ? 0xFFFF : x));
+        x = fx_mul32_hi(x << 1, e);
+    }
+
+    return x;
+}
+
+uint32_t fx_udiv(uint32_t n, uint32_t d)
+{
+    uint32_t q, dn = d;
+    uint8_t s = 0;
+
+    if (d <= 1) return n;
+    if (n < d) return 0;
+
+    if (dn > 0xFFFF) {
+        // Quotient of the reduced operands differs only by a few counts from the exact one
+        while (dn > 0xFFFF) {
+            dn >>= 1;
+            s++;
+        }
+        q = fx_mul32_hi(n >> s, recip_norm((uint16_t)dn) << 1);
+    }
+    else {
+        // Normalize the divisor to [2^15, 2^16)
+        while (dn < 0x8000) {
+            dn <<= 1;
+            s++;
+        }
+        q = fx_mul32_hi(n, recip_norm((uint16_t)dn) << (s + 1));
+    }
+
+    // Correct the estimate to the exact quotient
+    while (q * d > n) q--;
+    while (n - q * d >= d) q++;
+
+    return q;
+}
+
+int32_t fx_sdiv(int32_t n, int32_t d)
+{
+    uint32_t q = fx_udiv(n < 0 ? -(uint32_t)n : (uint32_t)n, d < 0 ? -(uint32_t)d : (uint32_t)d);
+    return ((n < 0) != (d < 0)) ? -(int32_t)q : (int32_t)q;
+}
@@ -0,0 +1,45 @@
+#ifndef FIXMATH_H_
+#define FIXMATH_H_
+
+#include <stdint.h>
+
+/*
+ * Fixed-point math on the MPY32 hardware multiplier.
+ *
+ * NOTE: The interrupt handlers do not save the multiplier registers,
+ * so these functions must only be called from the main thread.
+ */
+
+// Reciprocal of a divisor which is used many times (calibration constants etc.)
+typedef struct {
+    uint32_t m;             // floor((2^32 - 1) / d)
+    uint32_t d;
+} FxRecip;
+
+// Compile time reciprocal of a constant divisor
+#define FX_RECIP(d) { 0xFFFFFFFFUL / (d), (d) }
+
+// Multiplication
+uint32_t fx_mul_u16(uint16_t a, uint16_t b);
+int32_t fx_mul_s16(int16_t a, int16_t b);
+uint32_t fx_mul32_hi(uint32_t a, uint32_t b);
+
+// Multiply-accumulate. Clear the accumulator, add products and read the 32-bit sum.
+void fx_mac_clear(void);
+void fx_mac_u16(uint16_t a, uint16_t b);
+uint32_t fx_mac_read(void);
+
+// Saturating operations
+int16_t fx_sat16(int32_t x);
+int16_t fx_add_sat16(int16_t a, int16_t b);
+
+// Exact division by a precomputed reciprocal
+void fx_recip_init(FxRecip *r, uint32_t d);
+uint32_t fx_div_recip(uint32_t n, const FxRecip *r);
+
+// Division through a Newton-Raphson reciprocal, rounded toward zero like the C operator.
+// The quotient must fit in 16 bits. d must not be zero.
+uint32_t fx_udiv(uint32_t n, uint32_t d);
+int32_t fx_sdiv(int32_t n, int32_t d);
+
+#endif /* FIXMATH_H_ */
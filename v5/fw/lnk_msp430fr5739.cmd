@@ -59,8 +59,8 @@ MEMORY
     RAM                     : origin = 0x1C00, length = 0x0400
     INFOA                   : origin = 0x1880, length = 0x0080
     INFOB                   : origin = 0x1800, length = 0x0080
-    FRAM_VARS				: origin = 0xC200, length = 0x0410
-    FRAM                    : origin = 0xC610, length = 0x3970
+    FRAM_VARS				: origin = 0xC200, length = 0x0820
+    FRAM                    : origin = 0xCA20, length = 0x3560
     JTAGSIGNATURE           : origin = 0xFF80, length = 0x0004, fill = 0xFFFF
     BSLSIGNATURE            : origin = 0xFF84, length = 0x0004, fill = 0xFFFF
     IPESIGNATURE            : origin = 0xFF88, length = 0x0008, fill = 0xFFFF
@@ -132,7 +132,7 @@ SECTIONS
     {
        GROUP(READ_WRITE_MEMORY)
        {
-          .TI.persistent : {}                /* For #pragma persistent            */
+          .TI.persistent : {}                /* For #pragma persistent (burst buffer) */
           .cio        : {}                   /* C I/O buffer                      */
           .sysmem     : {}                   /* Dynamic memory allocation area    */
        } ALIGN(0x0200), RUN_START(fram_rw_start)
@@ -11,6 +11,7 @@
 #include "adc.h"
 
 #include "calc.h"
+#include "fixmath.h"
 
 static volatile int interrupt_pending = 0;
 
@@ -21,51 +22,551 @@ static volatile int interrupt_pending = 0;
 #define RS485_PRI_DIR_TX() PJOUT |= BIT3
 #define RS485_PRI_DIR_RX() PJOUT &= ~BIT3
 
+// In the address-bit mode the receiver is kept dormant between frames appointed to us,
+// so only address characters cause RX interrupts. See bus_frame.h.
+#ifdef BUS_ADDRESS_BIT_MODE
+#define BUS_RX_DORMANT() UCA1CTLW0 |= UCDORM
+#define BUS_RX_AWAKE()   UCA1CTLW0 &= ~UCDORM
+#else
+#define BUS_RX_DORMANT()
+#define BUS_RX_AWAKE()
+#endif
+
+// UCA1 divider setting and the matching TB2 inter-byte timeout
+typedef struct {
+	uint16_t brw, mctlw;
+	uint16_t timeout;
+} UartRate;
+
 typedef struct {
 	int active_bus;
 
-	const uint8_t* tx_buf;
-	size_t tx_idx, tx_len;
+	// A response is being transmitted
+	volatile int tx_busy;
+
+	// The main thread sleeps until no frame is being received
+	volatile int line_wait;
+
+	// Baud rate timing of the received frame in BAUD_TIMER ticks
+	uint16_t rx_start, rx_ticks;
+	uint16_t rx_chars;
 
-	int slave_rxed;
+	// Bus speed switched to when the response has been sent
+	UartRate next_rate;
+	int next_rate_pending;
+
+	// Systick of the latest frame received at a high speed
+	uint16_t speed_rx_tick;
+
+	// Time of the latest character on the bus in BAUD_TIMER ticks and systicks
+	uint16_t rx_last, rx_last_tick;
+
+	// The bus has been reserved for mastering and a response is held in the receive queue
+	int mastering;
+	int master_rsp;
+
+	// Reception times of the queued frames, in the order of the receive queue
+	stopwatch_t rx_done[BUS_RX_SLOTS];
+	uint8_t rx_done_in, rx_done_out;
 } BusDriver;
 
 #define BUS_ID_PRIMARY 0
 
+////////////////////////////////////////////////////////////////////////////////
+/// Automatic baud rate
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * The RX interrupt timestamps the first and the last character of every frame appointed
+ * to us with TA1, which runs from SMCLK/8. The UART divider N = BRCLK/baud follows as
+ * 8 timer ticks per bit. The divider is smoothed over frames and the UART is retuned
+ * before the response is sent, when the bus is quiet.
+ */
+
+#define BAUD_BRCLK          12000000UL          // SMCLK
+#define BAUD_TIMER_DIV      8                   // TA1 ticks per SMCLK/8
+#ifdef BUS_ADDRESS_BIT_MODE
+#define BAUD_CHAR_BITS      11                  // Start, 8 data, address and stop bit
+#else
+#define BAUD_CHAR_BITS      10                  // Start, 8 data and stop bit
+#endif
+
+// Divider of the OBC rate (~111607 baud) in Q8 and the hand-tuned UART setting the UART is initialized to
+#define BAUD_DEFAULT_N      27525
+#define BAUD_DEFAULT_BRW    6
+#define BAUD_DEFAULT_MCTLW  (UCOS16 | UCBRF_10 | 0x6B00)
+#define BAUD_DEFAULT_TIMEOUT 399                // TB2 ticks, about 3 characters
+
+// Divider of a nominal rate in Q8
+#define BAUD_N(rate)        (uint16_t)(((BAUD_BRCLK << 8) + (rate) / 2) / (rate))
+
+#pragma SET_DATA_SECTION(".fram_vars")
+uint8_t BAUD_MODE = BAUD_MODE_AUTO;
+#pragma SET_DATA_SECTION()
+
+// Divider of the selected bus speed and the smoothed divider in Q8
+static uint16_t baud_nominal = BAUD_DEFAULT_N;
+static uint16_t baud_n = BAUD_DEFAULT_N;
+
+// UCBRSx for the fractional part of N in Q8 (see MSP430FR57xx User's Guide, UCBRSx settings table)
+static const struct {
+	uint8_t frac, brs;
+} UCBRS_TABLE[] = {
+    {  0, 0x00}, { 14, 0x01}, { 19, 0x02}, { 22, 0x04}, { 26, 0x08}, { 33, 0x10},
+    { 37, 0x20}, { 43, 0x11}, { 55, 0x21}, { 57, 0x22}, { 65, 0x44}, { 77, 0x25},
+    { 86, 0x49}, { 92, 0x4A}, { 97, 0x52}, {103, 0x92}, {110, 0x53}, {113, 0x55},
+    {129, 0xAA}, {147, 0x6B}, {154, 0xAD}, {161, 0xB5}, {165, 0xB6}, {171, 0xD6},
+    {180, 0xB7}, {183, 0xBB}, {193, 0xDD}, {202, 0xED}, {205, 0xEE}, {214, 0xBF},
+    {217, 0xDF}, {220, 0xEF}, {225, 0xF7}, {231, 0xFB}, {235, 0xFD}, {238, 0xFE},
+};
+
+// UCBRSx for the divider n (Q8)
+static uint8_t uart_brs(uint16_t n) {
+	uint8_t frac = n & 0xff;
+	uint8_t brs = 0;
+	uint8_t i;
+
+	for (i = 0; i < sizeof(UCBRS_TABLE) / sizeof(UCBRS_TABLE[0]); i++) {
+		if (frac >= UCBRS_TABLE[i].frac)
+			brs = UCBRS_TABLE[i].brs;
+	}
+
+	return brs;
+}
+
+/*
+ * UART setting for the divider n (Q8). Oversampling needs N >= 16, so the high
+ * speeds use the low-frequency mode. The inter-byte timeout scales with N.
+ * NOTE: Uses fixmath, call from the main thread only.
+ */
+static void uart_rate(uint16_t n, UartRate* rate) {
+	if (n == BAUD_DEFAULT_N) {
+		rate->brw = BAUD_DEFAULT_BRW;
+		rate->mctlw = BAUD_DEFAULT_MCTLW;
+	}
+	else if (n >= (16 << 8)) {
+		// UCBRFx = N mod 16
+		rate->brw = n >> 12;
+		rate->mctlw = UCOS16 | (((n >> 8) & 0x0f) << 4) | ((uint16_t)uart_brs(n) << 8);
+	}
+	else {
+		rate->brw = n >> 8;
+		rate->mctlw = (uint16_t)uart_brs(n) << 8;
+	}
+
+	rate->timeout = fx_udiv(fx_mul_u16(BAUD_DEFAULT_TIMEOUT, n), BAUD_DEFAULT_N);
+}
+
+/*
+ * Retune UCA1 and the inter-byte timeout if the setting changes.
+ * NOTE: The UART is reset, so UCA1IE must be set again afterwards.
+ */
+static void uart_apply(const UartRate* rate) {
+	TB2CCR0 = rate->timeout;
+
+	if (UCA1BRW == rate->brw && UCA1MCTLW == rate->mctlw)
+		return;
+
+	UCA1CTLW0 |= UCSWRST;
+	UCA1BRW = rate->brw;
+	UCA1MCTLW = rate->mctlw;
+	UCA1CTLW0 &= ~UCSWRST;
+}
+
+/*
+ * Fold the timing of the latest received frame into the divider and retune the UART.
+ * Called from the main thread before a response is sent, when the bus is quiet.
+ */
+static void bus_autobaud_update(BusDriver* driver) {
+	UartRate rate;
+	uint16_t chars = driver->rx_chars;
+	driver->rx_chars = 0;
+
+	if (BAUD_MODE != BAUD_MODE_AUTO) {
+		baud_n = baud_nominal;
+		uart_rate(baud_n, &rate);
+		uart_apply(&rate);
+		return;
+	}
+
+	if (chars == 0)
+		return;
+
+	// N = BRCLK/baud = BAUD_TIMER_DIV * ticks per bit
+	uint32_t ticks = fx_mul_u16(driver->rx_ticks, BAUD_TIMER_DIV << 8);
+	uint16_t bits = chars * BAUD_CHAR_BITS;
+	if ((ticks >> 16) >= bits)
+		return;
+	uint16_t n = fx_udiv(ticks, bits);
+
+	// Gaps between the characters make a frame look slower. Frames more than 1/16
+	// off from the current rate cannot have been received properly and are ignored.
+	int16_t diff = n - baud_n;
+	int16_t limit = baud_n >> 4;
+	if (diff >= limit || diff <= -limit)
+		return;
+
+	baud_n += diff / 4;
+	uart_rate(baud_n, &rate);
+	uart_apply(&rate);
+}
+
+uint32_t bus_baud_rate(void) {
+	return (BAUD_BRCLK << 8) / baud_n;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Bus speed
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * The bus master selects a high speed with CMD_CONFIG_BUS_SPEED. The response is sent
+ * at the old speed and the UART is switched in the transmit complete interrupt.
+ * If no frame is received at the high speed for BUS_SPEED_REVERT_TICKS, the bus falls
+ * back to the default speed, so a lost switch does not leave the sensor unreachable.
+ * The rate measurement of BAUD_MODE_AUTO continues around the selected speed.
+ */
+
+#define BUS_SPEED_REVERT_TICKS  125             // 2 s
+
+static const struct {
+	uint16_t n;
+	uint32_t rate;
+} BUS_SPEEDS[] = {
+	{ BAUD_DEFAULT_N,     115200 },             // BUS_SPEED_DEFAULT
+	{ BAUD_N(460800),     460800 },             // BUS_SPEED_460800
+	{ BAUD_N(921600),     921600 },             // BUS_SPEED_921600
+};
+
+static uint8_t bus_speed_selected = BUS_SPEED_DEFAULT;
+static uint8_t bus_speed_requested = BUS_SPEED_DEFAULT;
+
+void bus_set_speed(uint8_t speed) {
+	if (speed <= BUS_SPEED_921600)
+		bus_speed_requested = speed;
+}
+
+uint8_t bus_speed(void) {
+	return bus_speed_selected;
+}
+
 BusFrame* bus_slave_receive(BusHandle* self) {
+	return bus_peek_rx_frame(self);
+}
+
+// Command service latency histogram, see BUS_LATENCY_BINS
+static uint32_t bus_latency[BUS_LATENCY_BINS];
+
+/*
+ * Free the oldest received frame. Returns the time it was received.
+ * NOTE: Call with the receive interrupt masked.
+ */
+static const stopwatch_t* bus_release(BusHandle* self) {
 	BusDriver* driver = (BusDriver*)self->driver;
-	if (driver->slave_rxed) {
-		driver->slave_rxed = 0;
-		return &self->frame_rx;
+	const stopwatch_t* rx_done = &driver->rx_done[driver->rx_done_out];
+
+	bus_release_rx_frame(self);
+	if (++driver->rx_done_out >= BUS_RX_SLOTS)
+		driver->rx_done_out = 0;
+
+	return rx_done;
+}
+
+// Add the service time of a command to the latency histogram
+static void bus_latency_update(const stopwatch_t* rx_done) {
+	uint32_t elapsed = stopwatch_elapsed(rx_done);
+	uint32_t limit = STOPWATCH_TICKS_PER_MS;
+	uint8_t bin = 0;
+
+	while (bin < BUS_LATENCY_BINS - 1 && elapsed >= limit) {
+		limit <<= 2;
+		bin++;
 	}
-	return NULL;
+	bus_latency[bin]++;
 }
 
-void bus_slave_send(BusHandle* self, BusFrame* rsp) {
+/*
+ * Wait until the previous frame has been sent and no frame is being received,
+ * then take the bus. Returns with the receiver disabled.
+ */
+static void bus_take_line(BusHandle* self) {
 	BusDriver* driver = (BusDriver*)self->driver;
 
-	// Make sure interrupts are disabled. Technically they should
-	// be by this point, because bus_slave_send() is called _ONLY_
-	// after the slave has received and handled a frame
+	__disable_interrupt();
+	driver->line_wait = 1;
+	while (driver->tx_busy || self->rx_index != 0) {
+		__bis_SR_register(LPM0_bits | GIE);
+		__disable_interrupt();
+	}
+	driver->line_wait = 0;
 	UCA1IE = 0;
+	TB2CTL &= ~MC__UPDOWN;
+	TB2CCTL0 = 0;
+	driver->tx_busy = 1;
+	__enable_interrupt();
+}
+
+/*
+ * Transmit a frame from bus_get_tx_frame() after bus_take_line().
+ */
+static void bus_transmit(BusHandle* self, BusFrame* frame) {
+	BusDriver* driver = (BusDriver*)self->driver;
 
 	// Prepare for transmitting
-	const BusFrame* tx_frame = bus_prepare_tx_frame(rsp);
-	driver->tx_buf = tx_frame->buf;
-	driver->tx_len = tx_frame->len + BUS_OVERHEAD;
-	driver->tx_idx = 0;
+	const BusFrame* tx_frame = bus_prepare_tx_frame(frame);
+	bus_next_tx_frame(self);
 
 	// Begin transfer
-	// NOTE: TX empty buffer flag needs to be set manually
+	// NOTE: DMA channel 2 feeds the transmit buffer and the bus is turned
+	// around in the transmit complete interrupt
 	if (driver->active_bus == BUS_ID_PRIMARY) {
 		RS485_PRI_DIR_TX();
-		UCA1IFG = UCTXIFG;
-		UCA1IE = UCTXIE;
+#ifdef BUS_ADDRESS_BIT_MODE
+		DMA_UART_TX_ADDRESS(tx_frame->dst, tx_frame->buf, tx_frame->len + BUS_OVERHEAD);
+#else
+		DMA_UART_TX(tx_frame->buf, tx_frame->len + BUS_OVERHEAD);
+#endif
+	}
+}
+
+void bus_slave_send(BusHandle* self, BusFrame* rsp) {
+	BusDriver* driver = (BusDriver*)self->driver;
+
+	// The receiver runs while the commands are handled, so take the bus first
+	bus_take_line(self);
+
+	// The command has been handled. The receiver is disabled, so the slot
+	// and its reception time stay valid until the response is sent.
+	const stopwatch_t* rx_done = bus_release(self);
+
+	// Follow the rate of the master
+	bus_autobaud_update(driver);
+	driver->speed_rx_tick = sys_ticks;
+
+	// Switch the speed after the response
+	uint8_t speed = bus_speed_requested;
+	if (speed != bus_speed_selected) {
+		uart_rate(BUS_SPEEDS[speed].n, &driver->next_rate);
+		driver->next_rate_pending = 1;
+
+		bus_speed_selected = speed;
+		baud_nominal = baud_n = BUS_SPEEDS[speed].n;
+		self->baud_rate = BUS_SPEEDS[speed].rate;
+	}
+
+	bus_latency_update(rx_done);
+	bus_transmit(self, rsp);
+}
+
+#ifdef BUS_MASTERING_API
+
+/*
+ * Bus mastering. There is no separate access line, so the bus is taken by carrier sense:
+ * it must have been quiet for BUS_MIN_DELAY plus a random backoff from bus_rand(), and
+ * any character during the wait costs a try. Commands to our device always come first.
+ * NOTE: In BUS_ADDRESS_BIT_MODE the dormant receiver only sees the address characters
+ * of other frames, so a frame in progress is detected by UCBUSY alone.
+ */
+
+#define BUS_TIMER_TICKS_PER_MS  (BAUD_BRCLK / BAUD_TIMER_DIV / 1000)
+#define BUS_BACKOFF_MASK        0x07                // Up to 7 ms of random backoff
+
+// Give up taking the bus after the time all the tries could take, in systicks
+#define BUS_MASTER_TAKE_TICKS   ((BUS_MAX_MASTER_TRIES * (BUS_MIN_DELAY + BUS_BACKOFF_MASK + MAX_FRAME_DURATION)) / 16 + 1)
+
+// The bus has been quiet for at least ms, which must not exceed one systick (16 ms)
+static int bus_quiet(BusDriver* driver, uint16_t ms) {
+	__disable_interrupt();
+	uint16_t ticks = TA1R - driver->rx_last;
+	uint16_t systicks = sys_ticks - driver->rx_last_tick;
+	__enable_interrupt();
+
+	// TA1 may have wrapped after two systicks, but then over 16 ms have passed
+	if (systicks >= 2)
+		return 1;
+	return ticks >= ms * BUS_TIMER_TICKS_PER_MS;
+}
+
+/*
+ * Sleep until the bus has been quiet for ms after the latest character. TA1CCR1 wakes
+ * the CPU then. A character in between moves rx_last, which is seen after the wakeup.
+ */
+static void bus_quiet_wait(BusDriver* driver, uint16_t ms) {
+	__disable_interrupt();
+	TA1CCR1 = driver->rx_last + ms * BUS_TIMER_TICKS_PER_MS;
+	TA1CCTL1 = CCIE;
+
+	// The compare may have passed before it was set, but then the bus is quiet already
+	if (!bus_quiet(driver, ms))
+		__bis_SR_register(LPM0_bits | GIE);
+	__enable_interrupt();
+}
+
+#if defined(__TI_COMPILER_VERSION__) || defined(__IAR_SYSTEMS_ICC__)
+#pragma vector=TIMER1_A1_VECTOR
+__interrupt void bus_quiet_irq()
+#elif defined(__GNUC__)
+void __attribute__ ((interrupt(TIMER1_A1_VECTOR))) bus_quiet_irq()
+#else
+#error Compiler not supported!
+#endif
+{
+	switch (__even_in_range(TA1IV, 0x0E)) {
+		case 0x02: {	// Vector 2 - TA1CCR1, the quiet time is over
+			TA1CCTL1 = 0;
+			__bic_SR_register_on_exit(LPM0_bits);
+		} break;
+		default: break;
+	}
+}
+
+int bus_master_take(BusHandle* self) {
+	BusDriver* driver = (BusDriver*)self->driver;
+	uint16_t start = sys_ticks;
+	int tries;
+
+	for (tries = 0; tries < BUS_MAX_MASTER_TRIES; tries++) {
+		uint16_t delay = BUS_MIN_DELAY + (bus_rand() & BUS_BACKOFF_MASK);
+		uint16_t last = driver->rx_last;
+
+		// Wait for the bus to stay quiet over the delay. Our own previous frame counts as traffic.
+		while (!bus_quiet(driver, delay)) {
+			if (self->rx_count != 0 || (uint16_t)(sys_ticks - start) > BUS_MASTER_TAKE_TICKS) {
+				TA1CCTL1 = 0;
+				return 0;
+			}
+			if (driver->rx_last != last)
+				break;
+
+			bus_quiet_wait(driver, delay);
+		}
+		TA1CCTL1 = 0;
+
+		__disable_interrupt();
+		if (bus_quiet(driver, delay) && !driver->tx_busy && self->rx_index == 0
+				&& self->rx_count == 0 && !(UCA1STATW & UCBUSY)) {
+			driver->mastering = 1;
+			__enable_interrupt();
+			return 1;
+		}
+		__enable_interrupt();
+	}
+
+	return 0;
+}
+
+void bus_master_give(BusHandle* self) {
+	BusDriver* driver = (BusDriver*)self->driver;
+
+	if (driver->master_rsp) {
+		driver->master_rsp = 0;
+		bus_slave_discard(self);
 	}
+	driver->mastering = 0;
+}
+
+void bus_master_send(BusHandle* self, BusFrame* frame) {
+	BusDriver* driver = (BusDriver*)self->driver;
+
+	if (!driver->mastering)
+		return;
+
+	bus_take_line(self);
+	bus_transmit(self, frame);
 }
 
+BusFrame* bus_master_transfer(BusHandle* self, BusFrame* cmd) {
+	BusDriver* driver = (BusDriver*)self->driver;
+
+	if (!driver->mastering)
+		return NULL;
+
+	// Only one response is held at a time
+	if (driver->master_rsp) {
+		driver->master_rsp = 0;
+		bus_slave_discard(self);
+	}
+
+	uint8_t dst = cmd->dst;
+	bus_master_send(self, cmd);
+	if (dst == BUS_ADDRESS_BROADCAST)
+		return NULL;
+
+	// Wait for the response. A command from someone else is left for the slave.
+	timestamp_t start = get_timestamp();
+	while ((timestamp_t)(get_timestamp() - start) <= BUS_MASTER_RECEIVE_TIMEOUT + MAX_FRAME_DURATION) {
+		BusFrame* rsp = bus_peek_rx_frame(self);
+		if (rsp != NULL) {
+			if (rsp->src != dst)
+				return NULL;
+
+			driver->master_rsp = 1;
+			return rsp;
+		}
+
+		__disable_interrupt();
+		if (self->rx_count == 0)
+			__bis_SR_register(LPM0_bits | GIE);
+		__enable_interrupt();
+	}
+
+	return NULL;
+}
+
+#endif /* BUS_MASTERING_API */
+
 static BusHandle bus_adcs;
 
+void bus_slave_discard(BusHandle* self) {
+	__disable_interrupt();
+	bus_release(self);
+	__enable_interrupt();
+}
+
+void bus_stats(BusStats* stats, uint32_t* latency) {
+	__disable_interrupt();
+	*stats = bus_adcs.stats;
+	__enable_interrupt();
+
+	memcpy(latency, bus_latency, sizeof(bus_latency));
+}
+
+// Additional receive and transmit slots. They do not fit in RAM next to bus_adcs.
+#pragma SET_DATA_SECTION(".fram_vars")
+static BusFrame bus_rx_slots[BUS_RX_SLOTS - 1];
+static BusFrame bus_tx_slots[BUS_TX_SLOTS - 1];
+#pragma SET_DATA_SECTION()
+
+uint32_t bus_active_rate(void) {
+	return bus_adcs.baud_rate;
+}
+
+/*
+ * Fall back to the default speed after a silence at a high speed.
+ * Called from the main thread. The UART is retuned only between frames.
+ */
+static void bus_speed_revert(BusDriver* driver) {
+	UartRate rate;
+
+	if (bus_speed_selected == BUS_SPEED_DEFAULT)
+		return;
+	if ((uint16_t)(sys_ticks - driver->speed_rx_tick) < BUS_SPEED_REVERT_TICKS)
+		return;
+
+	uart_rate(BAUD_DEFAULT_N, &rate);
+
+	__disable_interrupt();
+	if (!driver->tx_busy && bus_adcs.rx_index == 0 && bus_adcs.rx_count == 0) {
+		uart_apply(&rate);
+		UCA1IE = UCRXIE;
+
+		bus_speed_selected = bus_speed_requested = BUS_SPEED_DEFAULT;
+		baud_nominal = baud_n = BAUD_DEFAULT_N;
+		bus_adcs.baud_rate = BUS_SPEEDS[BUS_SPEED_DEFAULT].rate;
+	}
+	__enable_interrupt();
+}
+
 #if defined(__TI_COMPILER_VERSION__) || defined(__IAR_SYSTEMS_ICC__)
 #pragma vector=TIMER2_B0_VECTOR
 __interrupt void bus_rx_timeout_irq()
@@ -75,15 +576,24 @@ void __attribute__ ((interrupt(TIMER2_B0_VECTOR))) bus_rx_timeout_irq()
 #error Compiler not supported!
 #endif
 {
+	BusDriver* driver = (BusDriver*)bus_adcs.driver;
+
 	TB2CTL &= ~MC__UPDOWN; // Put into stop mode
 
-	bus_adcs.receive_timeouts++;
+	// Only a frame cut short is a receive timeout
+	if (bus_adcs.rx_index != 0)
+		bus_adcs.stats.receive_timeouts++;
 
 	bus_reset_rx(&bus_adcs);
 
 	// Enable RX on bus
 	RS485_PRI_DIR_RX();
+	BUS_RX_DORMANT();
 	UCA1IE = UCRXIE;
+
+	// A response may be waiting for the line to become free
+	if (driver->line_wait)
+		__bic_SR_register_on_exit(LPM0_bits);
 }
 
 #if defined(__TI_COMPILER_VERSION__) || defined(__IAR_SYSTEMS_ICC__)
@@ -102,33 +612,84 @@ void __attribute__ ((interrupt(USCI_A1_VECTOR))) bus_primary_irq()
 		case USCI_UART_UCRXIFG: { // Receive buffer full
 			driver->active_bus = BUS_ID_PRIMARY;
 
-			// Enable receiver timeout timer
-			TB2CTL |= MC__UP | TACLR;
-			TB2CCTL0 = CCIE;
+			// Timestamp for the baud rate and the bus activity
+			uint16_t now = TA1R;
+			driver->rx_last = now;
+			driver->rx_last_tick = sys_ticks;
+
+#ifdef BUS_ADDRESS_BIT_MODE
+			// Address character of a new frame. UCADDR is cleared when the buffer is read.
+			if (UCA1STATW & UCADDR) {
+				if (bus_handle_rx_address(&bus_adcs, UCA1RXBUF)) {
+					BUS_RX_AWAKE();
+
+					// Enable receiver timeout timer
+					TB2CTL |= MC__UP | TACLR;
+					TB2CCTL0 = CCIE;
+				}
+				else {
+					// Someone else's frame, sleep through it
+					BUS_RX_DORMANT();
+					TB2CTL &= ~MC__UPDOWN;
+					TB2CCTL0 = 0;
+				}
+				break;
+			}
+#endif
+
+			// A frame starts from index 0
+			if (bus_adcs.rx_index == 0)
+				driver->rx_start = now;
 
-			if (bus_handle_rx_byte(&bus_adcs, UCA1RXBUF)) {
-				// Disable timer
+			int received = bus_handle_rx_byte(&bus_adcs, UCA1RXBUF);
+
+			if (bus_adcs.rx_index != 0) {
+				// Enable receiver timeout timer for the frame in progress
+				TB2CTL |= MC__UP | TACLR;
+				TB2CCTL0 = CCIE;
+			}
+			else {
+				// The frame was received, skipped or rejected, or the byte was noise
 				TB2CTL &= ~MC__UPDOWN;
 				TB2CCTL0 = 0;
 
-				// After receiving successfully a frame appointed to our device,
-				// disable receiver to make sure rx buffer won't get corrupted.
-				// Next function to be called is bus_slave_send().
-				UCA1IE = 0;
+				// A response may be waiting for the line to become free
+				if (driver->line_wait)
+					__bic_SR_register_on_exit(LPM0_bits);
+			}
+
+			if (received) {
+				// Time from the first to the last character of the frame
+				driver->rx_ticks = now - driver->rx_start;
+				driver->rx_chars = bus_adcs.rx_length - 1;
+
+				// The frame is queued and the receiver continues to the next slot
+				// while the main thread handles it.
+				BUS_RX_DORMANT();
+
+				stopwatch_start(&driver->rx_done[driver->rx_done_in]);
+				if (++driver->rx_done_in >= BUS_RX_SLOTS)
+					driver->rx_done_in = 0;
+
+				// Start the synchronous measurement right at the end of the trigger frame,
+				// so the sensors on the bus begin the integration at the same time
+				BusFrame* frame = bus_newest_rx_frame(&bus_adcs);
+				if (frame->cmd == CMD_SYNC_TRIGGER && frame->len == 2 && !sleep_mode)
+					acquisition_sync(((uint16_t)frame->data[1] << 8) | frame->data[0]);
 
 				// Wake up the main thread.
-				driver->slave_rxed = 1;
 				interrupt_pending = 1;
 				__bic_SR_register_on_exit(LPM0_bits);
 			}
+#ifdef BUS_ADDRESS_BIT_MODE
+			else if (bus_adcs.rx_state != BUS_STATE_RX_IN_PROGRESS) {
+				// The frame was rejected, wait for the next address character
+				BUS_RX_DORMANT();
+			}
+#endif
 		} break;
 		case USCI_UART_UCTXIFG: { // Transmit buffer empty
-			if (driver->tx_idx < driver->tx_len) {
-				UCA1TXBUF = driver->tx_buf[driver->tx_idx++];
-			} else {
-				UCA1IFG &= ~UCTXCPTIE; // NOTE: must be cleared or ISR will trigger on the previous byte
-				UCA1IE = UCTXCPTIE;
-			}
+			// Transmit buffer is fed by DMA channel 2
 		} break;
 		case USCI_UART_UCSTTIFG: { // Start bit received
 			UCA1IFG &= ~UCSTTIFG;
@@ -137,9 +698,24 @@ void __attribute__ ((interrupt(USCI_A1_VECTOR))) bus_primary_irq()
 			UCA1IE = 0;
 			UCA1IFG &= ~UCTXCPTIE;
 
+			// Switch to the speed selected by the command
+			if (driver->next_rate_pending) {
+				driver->next_rate_pending = 0;
+				uart_apply(&driver->next_rate);
+			}
+
 			// Go to receiver mode on bus
 			RS485_PRI_DIR_RX();
+			BUS_RX_DORMANT();
 			UCA1IE = UCRXIE;
+
+			// Our own frame is bus activity as well
+			driver->rx_last = TA1R;
+			driver->rx_last_tick = sys_ticks;
+
+			// Wake up the main thread waiting for the next response
+			driver->tx_busy = 0;
+			__bic_SR_register_on_exit(LPM0_bits);
 		} break;
 		default: break;
     }
@@ -171,13 +747,21 @@ volatile uint16_t sys_ticks = 0;
 #define RESET_WDT() (WDTCTL = WDTPW + WDTHOLD) // Disabled!
 #endif
 
-unsigned int idle_counter = ~0;
+/*
+ * Idle time since the last command in heartbeat ticks. The main loop wakes up for every
+ * frame and bus event as well, so its passes cannot be counted for the time.
+ */
+#define IDLE_SLEEP_TICKS    250     // 16ms*250 = 4s
+#define IDLE_RESET_TICKS    1250    // 16ms*1250 = 20s
+
+static uint16_t idle_start = 0;
 void reset_idle_counter(){
-    idle_counter = 0;
+    idle_start = sys_ticks;
 }
 
 // Sleep mode indicator flag. Sleep Mode - 0, Enabled - 1
 uint8_t sleep_mode = 1;
+uint32_t sleep_count = 0, wakeup_count = 0;
 void sleep()
 {
     // Disable boost converter (AKA shutdown profile sensor)
@@ -194,6 +778,7 @@ void sleep()
 
     // Set sleep mode flag on
     sleep_mode = 1;
+    sleep_count++;
 }
 
 void wakeup()
@@ -211,6 +796,7 @@ void wakeup()
 
     // Set sleep mode flag
     sleep_mode = 0;
+    wakeup_count++;
 }
 
 
@@ -333,12 +919,17 @@ static void platform_init() {
 		CSCTL0_H = 0; // Lock
 	}
 
+	// Baud rate timer configuration
+	{
+		TA1CTL = TASSEL__SMCLK | ID__8 | MC__CONTINUOUS | TACLR;   // 1.5 MHz, free running
+	}
+
 	// UART reception timeout timer configuration
 	{
 		TB2CTL = TBSSEL__SMCLK | ID__8 | MC__UP;
 		TB2CCTL0 = 0;
 		TB2R = 0;
-		TB2CCR0 = 399; // 0.2 msec
+		TB2CCR0 = BAUD_DEFAULT_TIMEOUT; // 0.27 msec, rescaled with the bus speed
 	}
 
 	// UART configuration
@@ -346,6 +937,9 @@ static void platform_init() {
 		// UCA1 (primary)
         UCA1CTLW0 = UCSWRST;                    // Set the state machine to reset
         UCA1CTLW0 |= UCSSEL__SMCLK;             // SMCLK (12MHz)
+#ifdef BUS_ADDRESS_BIT_MODE
+        UCA1CTLW0 |= UCMODE_2 | UCDORM;         // Address-bit multiprocessor mode, wait for an address character
+#endif
 
         // 12 MHz 115200 (see msp430fr5739 User's Guide page 491)
         UCA1MCTLW |= UCOS16;                    // Oversampling enabled
@@ -355,8 +949,14 @@ static void platform_init() {
         //UCA1MCTLW |= UCBRF_8 | 0x2000;          // Modulation UCBRSx=0x20, UCBRFx=8
 
         // Baud rate of OBC is 3% (111607) slower AND MESSES UP EVERYTHING
-        UCA1BRW = 6;                            // Set the baud rate to 115200 (12MHz)
-        UCA1MCTLW |= UCBRF_10 | 0x6B00;          // Modulation UCBRSx=0x6B, UCBRFx=10
+        // The rate is followed automatically from the received frames in BAUD_MODE_AUTO
+        UCA1BRW = BAUD_DEFAULT_BRW;             // Set the baud rate to 115200 (12MHz)
+        UCA1MCTLW = BAUD_DEFAULT_MCTLW;         // Modulation UCBRSx=0x6B, UCBRFx=10
+        bus_adcs.baud_rate = BUS_SPEEDS[BUS_SPEED_DEFAULT].rate;
+        bus_init_slots(&bus_adcs, bus_rx_slots, bus_tx_slots);
+#ifdef BUS_MASTERING_API
+        bus_seed(BUS_MY_ADDRESS);               // Different backoff on every device
+#endif
 
         UCA1CTLW0 &= ~UCSWRST;                  // Release the reset
         UCA1IE |= UCRXIE;                       // Enable USCI_A1 RX interrupt
@@ -372,7 +972,7 @@ static void platform_init() {
     /* Basic initalization */
     ADC_INIT();
     SPI_INIT();
-    DMA_INIT();                                 //Initialize DMA for SPI data transfer
+    DMA_INIT(x_data, y_data);                   //Initialize DMA for SPI data transfer
     INTEGRATION_TIMER_INIT();
     HB_TIMER_INIT();
 
@@ -411,37 +1011,56 @@ static void platform_loop() {
 
 		// Make sure that all interrupts are serviced before going to sleep
 		__disable_interrupt();
-		if (!interrupt_pending) {
+		if (!interrupt_pending && !acquisition_pending()) {
 			__bis_SR_register(LPM0_bits | GIE);
 		}
 		interrupt_pending = 0;
 		__enable_interrupt();
 
-		// Update slave bus
+		// Process the completed frame of the background acquisition
+		acquisition_process();
+
+		// Fall back to the default bus speed if the master has gone silent
+		bus_speed_revert(&bus_driver);
+
+		// Update slave bus. The next queued command is handled while
+		// the previous response is still being transmitted.
 		{
-			BusFrame* cmd = bus_slave_receive(&bus_adcs);
-			if (cmd != NULL) {
+			BusFrame* cmd;
+			while ((cmd = bus_slave_receive(&bus_adcs)) != NULL) {
 				BusFrame* rsp = bus_get_tx_frame(&bus_adcs);
-				handle_command(cmd, rsp);
-				bus_slave_send(&bus_adcs, rsp);
+				if (handle_command(cmd, rsp))
+					bus_slave_send(&bus_adcs, rsp);
+				else
+					bus_slave_discard(&bus_adcs);
+			}
+		}
+
+#ifdef BUS_MASTERING_API
+		// Publish the subscribed telemetry when the bus is free. The sample is
+		// skipped if the bus cannot be taken.
+		if (subscription_due()) {
+			BusFrame* frame = bus_get_tx_frame(&bus_adcs);
+			subscription_publish(frame);
+
+			if (bus_master_take(&bus_adcs)) {
+				bus_master_send(&bus_adcs, frame);
+				bus_master_give(&bus_adcs);
 			}
 		}
+#endif
 
-        TB0CTL |= TBCLR; // reset hb timer, but is it needed????????????????
+        // The heartbeat timer runs free, sys_ticks is the time base of the timestamps
+        uint16_t idle = sys_ticks - idle_start;
 
-        // Processor wakes up every 16ms --> Goes to sleep after 16ms*250 = 4s
-        if (idle_counter > 250 && !sleep_mode) {
+        // Goes to sleep after 4s without commands
+        if (idle > IDLE_SLEEP_TICKS && !sleep_mode) {
             // Goto "deepsleep" if UART is not actively used
             sleep();
         }
-        else {
-            idle_counter++;
-            // Resets itself after 16ms*1250 = 20s
-            if (idle_counter >= 1250) {
-
-                // Trigger Power-On-Reset (POR) after ~20 seconds of idling
-                PMMCTL0 |= PMMSWPOR;
-            }
+        else if (idle >= IDLE_RESET_TICKS) {
+            // Trigger Power-On-Reset (POR) after ~20 seconds of idling
+            PMMCTL0 |= PMMSWPOR;
         }
 	}
 }
@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 
+#include "bus.h"
+
 #define USE_WDT
 
 // Flip to enable or disable DEBUG mode
@@ -10,8 +12,39 @@
 
 extern uint8_t sleep_mode;
 
+// Number of sleeps and wakeups since the reset
+extern uint32_t sleep_count, wakeup_count;
+
+// Bus baud rate modes
+#define BAUD_MODE_FIXED     0x00    // UART is kept at the default rate of the OBC
+#define BAUD_MODE_AUTO      0x01    // UART follows the rate measured from the received frames
+
+extern uint8_t BAUD_MODE;
+
+// Measured rate of the bus master in baud
+uint32_t bus_baud_rate(void);
+
+// Bus speeds
+#define BUS_SPEED_DEFAULT   0x00    // Rate of the OBC (~115200 baud)
+#define BUS_SPEED_460800    0x01
+#define BUS_SPEED_921600    0x02
+
+// Select the bus speed. The switch takes place after the next response has been sent.
+void bus_set_speed(uint8_t speed);
+uint8_t bus_speed(void);
+
+// Nominal rate of the active bus speed in baud
+uint32_t bus_active_rate(void);
+
+// Command service latency histogram from the end of a command frame to the start of its
+// response. The bins are < 1 ms, < 4 ms, < 16 ms, < 64 ms, < 256 ms and longer.
+#define BUS_LATENCY_BINS    6
+
+// Copy the bus statistics and the latency histogram
+void bus_stats(BusStats *stats, uint32_t *latency);
+
 void CLOCK_INIT(void);
-void DMA_INIT(void);
+void DMA_INIT(uint8_t *x_dst, uint8_t *y_dst);
 void IO_INIT(void);
 
 void reset_idle_counter(void);
@@ -0,0 +1,23 @@
+#include "event.h"
+
+#include <msp430.h>
+
+volatile uint8_t pending_events = 0;
+
+uint8_t event_wait(uint8_t mask) {
+    uint8_t events;
+
+    for (;;) {
+        // Check and go to sleep atomically, so that an event posted in between can't be missed
+        __disable_interrupt();
+        events = pending_events & mask;
+        if (events)
+            break;
+        __bis_SR_register(LPM0_bits | GIE);
+    }
+
+    pending_events &= ~events;
+    __enable_interrupt();
+
+    return events;
+}
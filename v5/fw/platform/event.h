@@ -0,0 +1,22 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <stdint.h>
+
+// Events posted by interrupts to the main thread
+#define EVENT_READOUT   (0x01)  // Sensor readout completed or timed out
+#define EVENT_ADC       (0x02)  // ADC conversion completed
+#define EVENT_READOUT_START (0x04)  // Sensor readout DMA armed
+
+extern volatile uint8_t pending_events;
+
+// Post events from an interrupt. The ISR must also wake the CPU with __bic_SR_register_on_exit(LPM0_bits).
+#define EVENT_POST(events) (pending_events |= (events))
+
+/*
+ * Sleep in LPM0 until any of the given events has been posted.
+ * Returns the posted events from the mask and clears them.
+ */
+uint8_t event_wait(uint8_t mask);
+
+#endif
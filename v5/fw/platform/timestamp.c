@@ -1,5 +1,28 @@
 #include "timestamp.h"
 
+#include <msp430.h>
+
 timestamp_t get_timestamp(void) {
     return sys_ticks<<4; // shift 4 to multiply by 2^4 to get 1 ms
 }
+
+void stopwatch_start(stopwatch_t *sw) {
+    sw->systicks = sys_ticks;
+    sw->ticks = TA1R;
+}
+
+uint32_t stopwatch_elapsed(const stopwatch_t *sw) {
+    uint16_t ticks = TA1R - sw->ticks;
+    uint16_t systicks = sys_ticks - sw->systicks;
+
+    // TA1 cannot have wrapped in less than two systicks
+    if (systicks < 2)
+        return ticks;
+
+    // The systicks are off by less than one systick, which is under half of the TA1 period,
+    // so the number of wraps is the nearest one to the systick time.
+    int32_t wrapped = (int32_t)systicks * STOPWATCH_TICKS_PER_SYSTICK - ticks;
+    uint16_t wraps = (uint16_t)((wrapped + 0x8000) >> 16);
+
+    return ((uint32_t)wraps << 16) + ticks;
+}
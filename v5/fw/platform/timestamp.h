@@ -13,4 +13,22 @@ typedef uint16_t timestamp_t;
 
 timestamp_t get_timestamp(void);
 
+/*
+ * Stopwatch on the free running TA1 (SMCLK/8 = 1.5 MHz). TA1 wraps every 43.7 ms,
+ * so the systicks are counted as well to extend the range.
+ * NOTE: Valid while the heartbeat timer is not cleared during the measurement.
+ */
+#define STOPWATCH_TICKS_PER_MS      (1500)
+#define STOPWATCH_TICKS_PER_SYSTICK (16 * STOPWATCH_TICKS_PER_MS)
+
+typedef struct {
+    uint16_t ticks;
+    uint16_t systicks;
+} stopwatch_t;
+
+void stopwatch_start(stopwatch_t *sw);
+
+// Elapsed time in stopwatch ticks
+uint32_t stopwatch_elapsed(const stopwatch_t *sw);
+
 #endif
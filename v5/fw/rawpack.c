@@ -0,0 +1,96 @@
+#include "rawpack.h"
+
+#include <stddef.h>
+
+#define RICE_K_MAX   7
+#define ESCAPE_BITS  9  // Zigzag differences of 8-bit pixels are below 512
+
+typedef struct {
+    uint8_t *dst;
+    uint16_t len;
+    uint16_t max;
+    uint32_t acc;       // Pending bits in the low end
+    uint8_t bits;       // Number of pending bits, < 8 between the calls
+} BitWriter;
+
+// n <= 16
+static void put_bits(BitWriter *w, uint16_t value, uint8_t n) {
+    w->acc = (w->acc << n) | (value & ((1UL << n) - 1));
+    w->bits += n;
+
+    while (w->bits >= 8) {
+        w->bits -= 8;
+        // Keep counting past the end to tell that it did not fit
+        if (w->len < w->max)
+            w->dst[w->len] = (uint8_t)(w->acc >> w->bits);
+        w->len++;
+    }
+}
+
+static inline uint16_t zigzag(const uint8_t *p) {
+    int16_t d = (int16_t)p[0] - p[-1];
+    return d >= 0 ? (uint16_t)d << 1 : ((uint16_t)-d << 1) - 1;
+}
+
+// Smallest k with count * 2^k >= sum of the zigzag differences
+static uint8_t rice_parameter(const uint8_t *p, uint8_t count) {
+    uint16_t sum = 0;
+    uint16_t limit = count;
+    uint8_t i, k;
+
+    for (i = 0; i < count; i++)
+        sum += zigzag(p + i);   // < 32 * 511, no overflow
+
+    for (k = 0; k < RICE_K_MAX && limit < sum; k++)
+        limit <<= 1;
+
+    return k;
+}
+
+static void pack_profile(BitWriter *w, const uint8_t *profile) {
+    uint16_t first;
+
+    put_bits(w, profile[0], 8);
+
+    for (first = 1; first < RAWPACK_PIXELS; first += RAWPACK_BLOCK) {
+        const uint8_t *p = profile + first;
+        uint8_t count = (RAWPACK_PIXELS - first < RAWPACK_BLOCK) ? RAWPACK_PIXELS - first : RAWPACK_BLOCK;
+        uint8_t k = rice_parameter(p, count);
+        uint8_t i;
+
+        put_bits(w, k, 3);
+
+        for (i = 0; i < count; i++) {
+            uint16_t u = zigzag(p + i);
+            uint16_t q = u >> k;
+
+            if (q >= RAWPACK_ESCAPE) {
+                put_bits(w, (1 << RAWPACK_ESCAPE) - 1, RAWPACK_ESCAPE);
+                put_bits(w, u, ESCAPE_BITS);
+            }
+            else {
+                put_bits(w, (1 << (q + 1)) - 2, q + 1);
+                put_bits(w, u, k);
+            }
+
+            // Give up early on a noisy frame
+            if (w->len > w->max)
+                return;
+        }
+    }
+}
+
+uint16_t raw_pack(const uint8_t *x, const uint8_t *y, uint8_t *dst, uint16_t max) {
+    BitWriter w = { dst, 0, max, 0, 0 };
+
+    if (x != NULL)
+        pack_profile(&w, x);
+    if (y != NULL && w.len <= max)
+        pack_profile(&w, y);
+
+    // Pad the last byte
+    if (w.bits > 0)
+        put_bits(&w, 0, 8 - w.bits);
+
+    return (w.len <= max) ? w.len : 0;
+}
@@ -0,0 +1,29 @@
+#ifndef RAWPACK_H_
+#define RAWPACK_H_
+
+#include <stdint.h>
+
+/*
+ * Lossless packing of the raw profiles for CMD_GET_RAW.
+ *
+ * A profile is its first pixel in 8 bits and the differences of the next pixels
+ * in blocks of RAWPACK_BLOCK, each block beginning with its Rice parameter k in
+ * 3 bits. A difference is zigzag mapped (0, -1, 1, -2, ... -> 0, 1, 2, 3, ...)
+ * and coded as u >> k in unary (ones ended by a zero) and the k low bits of u.
+ * A quotient of RAWPACK_ESCAPE or more is sent as RAWPACK_ESCAPE ones and u in
+ * 9 bits. The bits are written MSB first and the last byte is padded with zeros.
+ *
+ * calibration/raw_codec.py has the host decoder.
+ */
+
+#define RAWPACK_PIXELS  256
+#define RAWPACK_BLOCK   32
+#define RAWPACK_ESCAPE  12
+
+/*
+ * Pack the given profiles (x and/or y, NULL to leave one out) into dst.
+ * Returns the packed length, or 0 if it would be longer than max.
+ */
+uint16_t raw_pack(const uint8_t *x, const uint8_t *y, uint8_t *dst, uint16_t max);
+
+#endif /* RAWPACK_H_ */
@@ -6,6 +6,7 @@
 #include "main.h"
 #include "adc.h"
 #include "calc.h"
+#include "rawpack.h"
 
 #ifdef DEBUG
 #define SAMPLING_LED_ON()  LED2_ON()
@@ -15,8 +16,6 @@
 #define SAMPLING_LED_OFF()
 #endif
 
-uint16_t FRAM_VAR filtered_arr[256];
-
 
 ////////////////////////////////////////////////////////////////////////////////
 /// Application command handling
@@ -28,470 +27,1262 @@ static void respond_with_status_code(BusFrame* rsp, uint8_t status_code) {
     rsp->data[0] = status_code;
 }
 
-static unsigned char wakeup_sensor(BusFrame *rsp){
+// Returns RSP_STATUS_SLEEP if the sensor was asleep, RSP_STATUS_OK if it is ready
+static uint8_t wakeup_sensor(void){
     if(sleep_mode){
         wakeup();
-        respond_with_status_code(rsp, RSP_STATUS_SLEEP);
+        return RSP_STATUS_SLEEP;
     }
-    return sleep_mode;
+    return RSP_STATUS_OK;
 }
 
-void handle_command(const BusFrame* cmd, BusFrame* rsp) {
-    // Stop the HB timer during command handling
-    //HB_TIMER_DISABLE();
+/*
+ * Get a measurement for a command. In continuous acquisition mode the latest background
+ * result is returned right away, otherwise the sensor is sampled and processed now.
+ * Returns RSP_STATUS_OK or the status code telling why no valid measurement is available.
+ */
+static uint8_t get_measurement(SensorResult *res) {
+    if ((ACQ_MODE & ACQ_MODE_CONTINUOUS) && last_result.status != SAMPLING_ERROR) {
+        // A frame has been processed since the wakeup
+        *res = last_result;
+    }
+    else {
+        if (!sample_and_process(res))
+            return RSP_STATUS_SAMPLING_ERROR;
+        if (ACQ_MODE & ACQ_MODE_CONTINUOUS) last_result = *res;
+    }
 
-	rsp->dst = cmd->src;
+    if (res->status != CALC_OK)
+        return RSP_STATUS_CALC_ERROR;
+    return RSP_STATUS_OK;
+}
 
-	switch (cmd->cmd) {
+/*
+ * In continuous acquisition mode, append the frame counter and the age of the result in ms
+ * to the response. Returns the number of bytes appended.
+ */
+static uint16_t append_frame_info(uint8_t *dst, const SensorResult *res) {
+    if (!(ACQ_MODE & ACQ_MODE_CONTINUOUS))
+        return 0;
+
+    uint16_t age = get_timestamp() - res->timestamp;
+    memcpy(dst, &res->frame, sizeof(res->frame));
+    memcpy(dst + sizeof(res->frame), &age, sizeof(age));
+    return sizeof(res->frame) + sizeof(age);
+}
 
-	    case CMD_GET_STATUS: {
-            /*
-             * General status/test command
-             */
+/*
+ * Measurement payloads of the single commands and the batch entries.
+ * Each returns the number of bytes written, including the frame info.
+ */
+static uint16_t put_position(uint8_t *dst, const SensorResult *res) {
+    memcpy(dst, &res->value_x, sizeof(res->value_x));
+    memcpy(dst + sizeof(res->value_x), &res->value_y, sizeof(res->value_y));
+    memcpy(dst + sizeof(res->value_x) + sizeof(res->value_y), &res->snr_x, sizeof(res->snr_x));
+    memcpy(dst + sizeof(res->value_x) + sizeof(res->value_y) + sizeof(res->snr_x), &res->snr_y, sizeof(res->snr_y));
+
+    uint16_t len = sizeof(res->value_x)+sizeof(res->value_y)+sizeof(res->snr_x)+sizeof(res->snr_y);
+    return len + append_frame_info(dst + len, res);
+}
 
-	        respond_with_status_code(rsp, sleep_mode ? RSP_STATUS_SLEEP : RSP_STATUS_OK);
-            break;
-        }
+static uint16_t put_vector(uint8_t *dst, const SensorResult *res) {
+    // The height in the same 1/8 pixel units as the center bins
+    uint16_t z = VALUE_Z * CENTER_SCALE;
 
-        case CMD_GET_RAW: {
-            /*
-             * DOES NOT SAMPLE SENSOR
-             * Get raw current measurements
-             */
+    memcpy(dst, &res->value_x, sizeof(res->value_x));
+    memcpy(dst + sizeof(res->value_x), &res->value_y, sizeof(res->value_y));
+    memcpy(dst + sizeof(res->value_x) + sizeof(res->value_y), &z, sizeof(z));
+    memcpy(dst + sizeof(res->value_x) + sizeof(res->value_y) + sizeof(z), &res->snr_x, sizeof(res->snr_x));
+    memcpy(dst + sizeof(res->value_x) + sizeof(res->value_y) + sizeof(z) + sizeof(res->snr_x), &res->snr_y, sizeof(res->snr_y));
 
-            // respond with the part number first
-            memcpy(rsp->data, cmd->data, sizeof(uint8_t)*1);
+    uint16_t len = sizeof(res->value_x)+sizeof(res->value_y)+sizeof(z)+sizeof(res->snr_x)+sizeof(res->snr_y);
+    return len + append_frame_info(dst + len, res);
+}
 
-            switch (cmd->data[0]){// switch according to part is to be returned
-                case 0: {
-                    memcpy(rsp->data+1, x_data, sizeof(uint8_t)*128);
-                    break;
-                }
-                case 1: {
-                    memcpy(rsp->data+1, x_data + 128, sizeof(uint8_t)*128);
-                    break;
-                }
-                case 2: {
-                    memcpy(rsp->data+1, y_data, sizeof(uint8_t)*128);
-                    break;
-                }
-                case 3: {
-                    memcpy(rsp->data+1, y_data + 128, sizeof(uint8_t)*128);
-                    break;
-                }
-                default: {
-                    respond_with_status_code(rsp, RSP_STATUS_INVALID_PARAM);
-                    break;
-                }
-            }
+static uint16_t put_sun_vector(uint8_t *dst, const SunVector *vec, const SensorResult *res) {
+    memcpy(dst, vec, sizeof(*vec));
+    memcpy(dst + sizeof(*vec), &res->snr_x, sizeof(res->snr_x));
+    memcpy(dst + sizeof(*vec) + sizeof(res->snr_x), &res->snr_y, sizeof(res->snr_y));
 
-            // Length (x_data/2) = 128
-            rsp->cmd = RSP_RAW;
-            rsp->len = 128+1;
-            break;
-        }
+    uint16_t len = sizeof(*vec)+sizeof(res->snr_x)+sizeof(res->snr_y);
+    return len + append_frame_info(dst + len, res);
+}
 
-        case CMD_GET_POSITION: {
-            /*
-             * Get position of the light spot
-             */
+// The values are already corrected for X_BIAS and Y_BIAS
+static uint8_t get_angles(const SensorResult *res, int16_t *angle_x, int16_t *angle_y) {
+    if (angle(res->value_x, angle_x) != CALC_OK || angle(res->value_y, angle_y) != CALC_OK)
+        return CALC_ERROR;
+    return CALC_OK;
+}
 
-            SAMPLING_LED_ON();
-            // Wakeup sensor if it's in sleep mode
-            if(wakeup_sensor(rsp)) break;
+static uint16_t put_angles(uint8_t *dst, int16_t angle_x, int16_t angle_y, const SensorResult *res) {
+    memcpy(dst, &angle_x, sizeof(angle_x));
+    memcpy(dst + sizeof(angle_x), &angle_y, sizeof(angle_y));
+    memcpy(dst + sizeof(angle_x) + sizeof(angle_y), &res->snr_x, sizeof(res->snr_x));
+    memcpy(dst + sizeof(angle_x) + sizeof(angle_y) + sizeof(res->snr_x), &res->snr_y, sizeof(res->snr_y));
 
+    uint16_t len = sizeof(angle_x)+sizeof(angle_y)+sizeof(res->snr_x)+sizeof(res->snr_y);
+    return len + append_frame_info(dst + len, res);
+}
 
-            if (!SAMPLE_SENSOR()){
-                respond_with_status_code(rsp, RSP_STATUS_SAMPLING_ERROR);
-                break;
-            }
+// Command flags
+#define CMD_AWAKE       0x01    // Wake up the sensor, respond RSP_STATUS_SLEEP if it was asleep
+#define CMD_WAKE        0x02    // Wake up the sensor and carry on
+#define CMD_MEASURE     0x04    // Run the measurement pipeline before the handler
+
+/*
+ * Wake up the sensor as told by the command flags.
+ * Returns RSP_STATUS_OK if the command can go on, or the status code to respond with.
+ */
+static uint8_t wake(uint8_t flags) {
+    if (flags & CMD_AWAKE) {
+        // Wakeup sensor if it's in sleep mode
+        return wakeup_sensor();
+    }
+    if ((flags & CMD_WAKE) && sleep_mode) {
+        wakeup();
+    }
+    return RSP_STATUS_OK;
+}
 
-            // Rolling filter checks if the sensor is saturated or not. If not perform quadratic middle calculation, if yes estimate with calc_middle
-            rolling_filter(x_data, filtered_arr);
-            if (quadratic_middle(filtered_arr, 'x') != CALC_OK) {
-                respond_with_status_code(rsp, RSP_STATUS_CALC_ERROR);
-                break;
-            }
+/*
+ * The measurement pipeline shared by the commands. Wakes up the sensor as told by the
+ * command flags, then samples, filters and interpolates the profiles or takes the latest
+ * background result. Returns RSP_STATUS_OK or the status code if there is no measurement.
+ */
+static uint8_t measure_status(SensorResult *res, uint8_t flags) {
+    uint8_t status = wake(flags);
+    if (status != RSP_STATUS_OK)
+        return status;
+
+    SAMPLING_LED_ON();
+    status = get_measurement(res);
+    SAMPLING_LED_OFF();
+
+    return status;
+}
 
-            // Rolling filter checks if the sensor is saturated or not. If not perform quadratic middle calculation, if yes estimate with calc_middle
-            rolling_filter(y_data, filtered_arr);
-            if (quadratic_middle(filtered_arr, 'y') != CALC_OK) {
-                respond_with_status_code(rsp, RSP_STATUS_CALC_ERROR);
-                break;
-            }
+// As measure_status(), returns 0 and fills in the response if there is no measurement
+static int measure(SensorResult *res, BusFrame *rsp, uint8_t flags) {
+    uint8_t status = measure_status(res, flags);
+    if (status != RSP_STATUS_OK) {
+        respond_with_status_code(rsp, status);
+        return 0;
+    }
+    return 1;
+}
 
+////////////////////////////////////////////////////////////////////////////////
+/// Configuration
+////////////////////////////////////////////////////////////////////////////////
 
-            SAMPLING_LED_OFF();
+/*
+ * Config sub command handlers. The getters write the value in the RSP_CONFIG format
+ * after the sub command and return its length. The setters get the data after the sub
+ * command, of the length declared in the config table, and return the status code.
+ */
 
-            rsp->cmd = RSP_POSITION;
+static uint16_t config_get_calibration(uint8_t *dst) {
+    /*
+     * Get the sensor bias values for the X, Y and Z center position of the light spot
+     * Also get Temp bias
+     */
 
-            memcpy(rsp->data, &VALUE_X, sizeof(VALUE_X));
-            memcpy(rsp->data + sizeof(VALUE_X), &VALUE_Y, sizeof(VALUE_Y));
-            memcpy(rsp->data + sizeof(VALUE_X) + sizeof(VALUE_Y), &SNR_X, sizeof(SNR_X));
-            memcpy(rsp->data + sizeof(VALUE_X) + sizeof(VALUE_Y) + sizeof(SNR_X), &SNR_Y, sizeof(SNR_Y));
+    memcpy(dst, &X_BIAS, sizeof(X_BIAS));
+    memcpy(dst + sizeof(X_BIAS), &Y_BIAS, sizeof(Y_BIAS));
+    memcpy(dst + sizeof(X_BIAS) + sizeof(Y_BIAS), &VALUE_Z, sizeof(VALUE_Z));
+    memcpy(dst + sizeof(X_BIAS) + sizeof(Y_BIAS) + sizeof(VALUE_Z), &TEMPERATURE_BIAS, sizeof(TEMPERATURE_BIAS));
 
-            rsp->len = sizeof(VALUE_X)+sizeof(VALUE_Y)+sizeof(SNR_X)+sizeof(SNR_Y);
-            break;
-        }
+    return sizeof(X_BIAS)+sizeof(Y_BIAS)+sizeof(VALUE_Z)+sizeof(TEMPERATURE_BIAS);
+}
 
-        case CMD_GET_VECTOR: {
-            /*
-             * This function returns a vector in the format [x_value, y_value, z_value, SNR_X, SNR_Y]
-             */
+static uint8_t config_set_calibration(const uint8_t *data) {
+    /*
+     * Set the sensor bias values for the X and Y center position of the light spot
+     * VALUE_Z is the pinhole height in pixels. The placeholder 1 of old calibrations is refused.
+     */
 
-            // Wakeup sensor if it's in sleep mode
-            if(wakeup_sensor(rsp)) break;
+    uint16_t z;
+    memcpy(&z, data + 4, sizeof(z));
+    if (z < VALUE_Z_MIN || z > VALUE_Z_MAX)
+        return RSP_STATUS_INVALID_PARAM;
 
-            if (!SAMPLE_SENSOR()){
-                respond_with_status_code(rsp, RSP_STATUS_SAMPLING_ERROR);
-                break;
-            }
+    memcpy(&X_BIAS, data, sizeof(X_BIAS));
+    memcpy(&Y_BIAS, data + 2, sizeof(Y_BIAS));
+    VALUE_Z = z;
+    memcpy(&TEMPERATURE_BIAS, data + 6, sizeof(TEMPERATURE_BIAS));
 
-            SAMPLING_LED_ON();
-            // Rolling filter checks if the sensor is saturated or not. If not perform quadratic middle calculation, if yes estimate with calc_middle
-            rolling_filter(x_data, filtered_arr);
-            if (quadratic_middle(filtered_arr, 'x') != CALC_OK) {
-                respond_with_status_code(rsp, RSP_STATUS_CALC_ERROR);
-                break;
-            }
+    return RSP_STATUS_OK;
+}
 
-            // Rolling filter checks if the sensor is saturated or not. If not perform quadratic middle calculation, if yes estimate with calc_middle
-            rolling_filter(y_data, filtered_arr);
-            if (quadratic_middle(filtered_arr, 'y') != CALC_OK) {
-                respond_with_status_code(rsp, RSP_STATUS_CALC_ERROR);
-                break;
-            }
+static uint16_t config_get_sat_level(uint8_t *dst) {
+    /*
+     * Get Sensor saturation level calibration value
+     */
+
+    memcpy(dst, &SAT_LEVEL, sizeof(SAT_LEVEL));
+    return sizeof(SAT_LEVEL);
+}
+
+static uint8_t config_set_sat_level(const uint8_t *data) {
+    /*
+     * Set sensor saturation level calibration value
+     */
+
+    memcpy(&SAT_LEVEL, data, sizeof(SAT_LEVEL));
+    return RSP_STATUS_OK;
+}
+
+static uint16_t config_get_int(uint8_t *dst) {
+    /*
+     * Get Sensor integration time variable
+     */
+
+    memcpy(dst, &INT_TIME, sizeof(INT_TIME));
+    return sizeof(INT_TIME);
+}
 
-            SAMPLING_LED_OFF();
+static uint8_t config_set_int(const uint8_t *data) {
+    /*
+     * Set the integration time of the sensor. This is a uint16_t value.
+     */
+
+    uint16_t temp_int_time;
+
+    memcpy(&temp_int_time, data, sizeof(temp_int_time));
+
+    // Prevent user from setting a too low integration time
+    if (temp_int_time < 3200)
+        return RSP_STATUS_INVALID_PARAM;
+
+    INT_TIME = temp_int_time;
+    return RSP_STATUS_OK;
+}
+
+static uint16_t config_get_sampling(uint8_t *dst) {
+    /*
+     * Get Sensor sampling time variable
+     */
+
+    memcpy(dst, &SAMPLING_TIME, sizeof(SAMPLING_TIME));
+    return sizeof(SAMPLING_TIME);
+}
+
+static uint8_t config_set_sampling(const uint8_t *data) {
+    /*
+     * Set the sensor sampling time. Setting a sampling value of less than 3100, use at your own risk. The sampling period should be over 3000.
+     * Anything less than this might result in unpredicted behavior of the DSS.
+     */
+
+    uint16_t temp_sampling_time;
+
+    memcpy(&temp_sampling_time, data, sizeof(temp_sampling_time));
+
+    // Prevent user from setting a too low sampling time
+    if (temp_sampling_time < 3200)
+        return RSP_STATUS_INVALID_PARAM;
+
+    SAMPLING_TIME = temp_sampling_time;
+    return RSP_STATUS_OK;
+}
+
+static uint16_t config_get_gain(uint8_t *dst) {
+    /*
+     * Get Sensor GAIN variable
+     */
+
+    memcpy(dst, &GAIN, sizeof(GAIN));
+    return sizeof(GAIN);
+}
 
-            rsp->cmd = RSP_VECTOR;
+static uint8_t config_set_gain(const uint8_t *data) {
+    /*
+     * Set the profile sensors gain --> High gain = 1 and Low gain = 0
+     */
 
-            memcpy(rsp->data, &VALUE_X, sizeof(VALUE_X));
-            memcpy(rsp->data + sizeof(VALUE_X), &VALUE_Y, sizeof(VALUE_Y));
-            memcpy(rsp->data + sizeof(VALUE_X) + sizeof(VALUE_Y), &VALUE_Z, sizeof(VALUE_Z));
-            memcpy(rsp->data + sizeof(VALUE_X) + sizeof(VALUE_Y) + sizeof(VALUE_Z), &SNR_X, sizeof(SNR_X));
-            memcpy(rsp->data + sizeof(VALUE_X) + sizeof(VALUE_Y) + sizeof(VALUE_Z) + sizeof(SNR_X), &SNR_Y, sizeof(SNR_Y));
+    if ((data[0] != 0x00) && (data[0] != 0x01))
+        return RSP_STATUS_INVALID_PARAM;
 
-            rsp->len = sizeof(VALUE_X)+sizeof(VALUE_Y)+sizeof(VALUE_Z)+sizeof(SNR_X)+sizeof(SNR_Y);
+    GAIN = data[0];
+    ss_gain(GAIN);
 
-            break;
+    return RSP_STATUS_OK;
+}
+
+static uint16_t config_get_acquisition(uint8_t *dst) {
+    /*
+     * Get the acquisition mode
+     */
+
+    dst[0] = ACQ_MODE;
+    return sizeof(ACQ_MODE);
+}
+
+static uint8_t config_set_acquisition(const uint8_t *data) {
+    /*
+     * Set the acquisition mode --> Single = 0, Continuous = 1, Streaming = 2
+     * In continuous mode the sensor is read out and processed every cycle on the background
+     * and the measurement commands return the latest result with its frame counter and age.
+     * In streaming mode a requested sample is filtered while the DMA is still reading it out.
+     */
+
+    if (data[0] & ~(ACQ_MODE_CONTINUOUS | ACQ_MODE_STREAMING))
+        return RSP_STATUS_INVALID_PARAM;
+
+    ACQ_MODE = data[0];
+    return RSP_STATUS_OK;
+}
+
+static uint16_t config_get_estimator(uint8_t *dst) {
+    /*
+     * Get the sub-pixel estimator
+     */
+
+    dst[0] = ESTIMATOR;
+    return sizeof(ESTIMATOR);
+}
+
+static uint8_t config_set_estimator(const uint8_t *data) {
+    /*
+     * Set the sub-pixel estimator --> Quadratic = 0, Gaussian = 1, 5-point = 2, Centroid = 3, Auto = 4
+     * Auto uses the centroid when the profile goes over SAT_LEVEL, otherwise the Gaussian fit
+     * for a narrow spot and the 5-point fit for a wide spot.
+     */
+
+    if (data[0] > EST_AUTO)
+        return RSP_STATUS_INVALID_PARAM;
+
+    ESTIMATOR = data[0];
+    return RSP_STATUS_OK;
+}
+
+static uint16_t config_get_baud(uint8_t *dst) {
+    /*
+     * Get the baud rate mode and the measured rate of the bus master
+     */
+
+    uint32_t baud = bus_baud_rate();
+
+    dst[0] = BAUD_MODE;
+    memcpy(dst+1, &baud, sizeof(baud));
+
+    return sizeof(BAUD_MODE)+sizeof(baud);
+}
+
+static uint8_t config_set_baud(const uint8_t *data) {
+    /*
+     * Set the baud rate mode --> Fixed = 0, Auto = 1
+     * In auto mode the UART follows the rate of the bus master measured from the received frames.
+     * The change takes effect when the response is sent.
+     */
+
+    if (data[0] > BAUD_MODE_AUTO)
+        return RSP_STATUS_INVALID_PARAM;
+
+    BAUD_MODE = data[0];
+    return RSP_STATUS_OK;
+}
+
+static uint16_t config_get_bus_speed(uint8_t *dst) {
+    /*
+     * Get the bus speed and its nominal rate
+     */
+
+    uint32_t baud = bus_active_rate();
+
+    dst[0] = bus_speed();
+    memcpy(dst+1, &baud, sizeof(baud));
+
+    return sizeof(uint8_t)+sizeof(baud);
+}
+
+static uint8_t config_set_bus_speed(const uint8_t *data) {
+    /*
+     * Set the bus speed --> Default = 0, 460800 = 1, 921600 = 2
+     * The response is sent at the old speed and the bus switches after it.
+     * The bus falls back to the default speed after 2 s without frames.
+     */
+
+    if (data[0] > BUS_SPEED_921600)
+        return RSP_STATUS_INVALID_PARAM;
+
+    bus_set_speed(data[0]);
+    return RSP_STATUS_OK;
+}
+
+typedef struct {
+    uint16_t (*get)(uint8_t *dst);
+    uint8_t (*set)(const uint8_t *data);
+    uint8_t set_len;                        // Length of the SET_CONFIG data after the sub command
+} ConfigEntry;
+
+// Config sub commands indexed by the low nibble of the code (0xB_)
+#define CONFIG_GROUP        0xB0
+#define CONFIG_INDEX(sub)   ((sub) & 0x0F)
+
+static const ConfigEntry config_table[16] = {
+    [CONFIG_INDEX(CMD_CONFIG_GAIN)]        = { config_get_gain,        config_set_gain,        sizeof(GAIN) },
+    [CONFIG_INDEX(CMD_CONFIG_CALIBRATION)] = { config_get_calibration, config_set_calibration, 4 * sizeof(int16_t) },
+    [CONFIG_INDEX(CMD_CONFIG_SAT_LEVEL)]   = { config_get_sat_level,   config_set_sat_level,   sizeof(SAT_LEVEL) },
+    [CONFIG_INDEX(CMD_CONFIG_INT)]         = { config_get_int,         config_set_int,         sizeof(INT_TIME) },
+    [CONFIG_INDEX(CMD_CONFIG_SAMPLING)]    = { config_get_sampling,    config_set_sampling,    sizeof(SAMPLING_TIME) },
+    [CONFIG_INDEX(CMD_CONFIG_ACQUISITION)] = { config_get_acquisition, config_set_acquisition, sizeof(ACQ_MODE) },
+    [CONFIG_INDEX(CMD_CONFIG_ESTIMATOR)]   = { config_get_estimator,   config_set_estimator,   sizeof(ESTIMATOR) },
+    [CONFIG_INDEX(CMD_CONFIG_BAUD)]        = { config_get_baud,        config_set_baud,        sizeof(BAUD_MODE) },
+    [CONFIG_INDEX(CMD_CONFIG_BUS_SPEED)]   = { config_get_bus_speed,   config_set_bus_speed,   sizeof(uint8_t) },
+};
+
+static const ConfigEntry* find_config(uint8_t sub) {
+    if ((sub & 0xF0) != CONFIG_GROUP)
+        return NULL;
+
+    const ConfigEntry *entry = &config_table[CONFIG_INDEX(sub)];
+    return entry->get != NULL ? entry : NULL;
+}
+
+/*
+ * Write the value of a config sub command in the format of the RSP_CONFIG response.
+ * Returns the length of the data or 0 if the sub command is unknown.
+ */
+static uint16_t get_config(uint8_t sub, uint8_t *dst) {
+    const ConfigEntry *entry = find_config(sub);
+    if (entry == NULL)
+        return 0;
+
+    dst[0] = sub;
+    return entry->get(dst + 1) + 1;
+}
+
+/*
+ * Batch request. The data is a list of commands, each CMD_GET_CONFIG followed by its
+ * sub command. The response carries an entry [response code, length, data] per command
+ * with the data of the single response. The measurement entries share one sample. A
+ * failed entry is RSP_STATUS with the status code, the other entries are kept.
+ */
+static void handle_batch(const BusFrame *cmd, BusFrame *rsp) {
+    SensorResult res;
+    uint8_t measured = 0;           // Status of the shared measurement, 0 until it is taken
+    uint16_t i = 0;
+    uint16_t len = 0;
+
+    while (i < cmd->len) {
+        uint8_t code = cmd->data[i++];
+        uint8_t *entry = rsp->data + len + BATCH_ENTRY_HEADER;
+        uint8_t tag = RSP_STATUS;
+        uint16_t n = 1;
+
+        if (len + BATCH_ENTRY_HEADER + BATCH_ENTRY_MAX > BUS_DATA_MAX) {
+            respond_with_status_code(rsp, RSP_STATUS_INVALID_PARAM);
+            return;
         }
-#ifdef CALC_ANGLES
-        case CMD_GET_ANGLES: {
-            /*
-             * Get sun angle
-             */
 
-            if(sleep_mode){
-                wakeup();
+        switch (code) {
+            case CMD_GET_STATUS: {
+                entry[0] = sleep_mode ? RSP_STATUS_SLEEP : RSP_STATUS_OK;
+                break;
             }
 
-            if (!SAMPLE_SENSOR()){
-                respond_with_status_code(rsp, RSP_STATUS_SAMPLING_ERROR);
+            case CMD_GET_TEMPERATURE: {
+                int16_t temp = read_tempC();
+
+                tag = RSP_TEMPERATURE;
+                memcpy(entry, &temp, sizeof(temp));
+                n = sizeof(temp);
                 break;
             }
 
-            // Rolling filter checks if the sensor is saturated or not. If not perform quadratic middle calculation, if yes estimate with calc_middle
-            rolling_filter(x_data, filtered_arr);
-            if (quadratic_middle(filtered_arr, 'x') != CALC_OK) {
-                respond_with_status_code(rsp, RSP_STATUS_CALC_ERROR);
+            case CMD_GET_CONFIG: {
+                if (i >= cmd->len) {
+                    respond_with_status_code(rsp, RSP_STATUS_INVALID_PARAM);
+                    return;
+                }
+
+                n = get_config(cmd->data[i++], entry);
+                if (n == 0) {
+                    entry[0] = RSP_STATUS_UNKNOWN_COMMAND;
+                    n = 1;
+                }
+                else {
+                    tag = RSP_CONFIG;
+                }
                 break;
             }
 
-            // Rolling filter checks if the sensor is saturated or not. If not perform quadratic middle calculation, if yes estimate with calc_middle
-            rolling_filter(y_data, filtered_arr);
-            if (quadratic_middle(filtered_arr, 'y') != CALC_OK) {
-                respond_with_status_code(rsp, RSP_STATUS_CALC_ERROR);
+            case CMD_GET_POSITION:
+            case CMD_GET_VECTOR:
+            case CMD_GET_SUN_VECTOR:
+            case CMD_GET_ANGLES: {
+                if (!measured) {
+                    measured = measure_status(&res, CMD_AWAKE);
+                }
+
+                if (measured != RSP_STATUS_OK) {
+                    entry[0] = measured;
+                }
+                else if (code == CMD_GET_POSITION) {
+                    tag = RSP_POSITION;
+                    n = put_position(entry, &res);
+                }
+                else if (code == CMD_GET_VECTOR) {
+                    tag = RSP_VECTOR;
+                    n = put_vector(entry, &res);
+                }
+                else if (code == CMD_GET_ANGLES) {
+                    int16_t angle_x, angle_y;
+                    if (get_angles(&res, &angle_x, &angle_y) != CALC_OK) {
+                        entry[0] = RSP_STATUS_CALC_ERROR;
+                    }
+                    else {
+                        tag = RSP_ANGLES;
+                        n = put_angles(entry, angle_x, angle_y, &res);
+                    }
+                }
+                else {
+                    SunVector vec;
+                    if (sun_vector(&res, &vec) != CALC_OK) {
+                        entry[0] = RSP_STATUS_CALC_ERROR;
+                    }
+                    else {
+                        tag = RSP_SUN_VECTOR;
+                        n = put_sun_vector(entry, &vec, &res);
+                    }
+                }
                 break;
             }
 
-            VALUE_X = angle(VALUE_X + X_BIAS);                   // Correct for X_BIAS
-            VALUE_Y = angle(VALUE_Y + Y_BIAS);                   // Correct for Y_BIAS
+            default:
+                /* Not available in a batch */
+                entry[0] = RSP_STATUS_UNKNOWN_COMMAND;
+                break;
+        }
 
-            rsp->cmd = RSP_ANGLES;
+        rsp->data[len] = tag;
+        rsp->data[len + 1] = n;
+        len += BATCH_ENTRY_HEADER + n;
+    }
 
-            memcpy(rsp->data, &VALUE_X, sizeof(VALUE_X));
-            memcpy(rsp->data + sizeof(VALUE_X), &VALUE_Y, sizeof(VALUE_Y));
-            memcpy(rsp->data + sizeof(VALUE_X) + sizeof(VALUE_Y), &SNR_X, sizeof(SNR_X));
-            memcpy(rsp->data + sizeof(VALUE_X) + sizeof(VALUE_Y) + sizeof(SNR_X), &SNR_Y, sizeof(SNR_Y));
+    rsp->cmd = RSP_BATCH;
+    rsp->len = len;
+}
 
-            rsp->len = sizeof(VALUE_X)+sizeof(VALUE_Y)+sizeof(SNR_X)+sizeof(SNR_X);
-            break;
-        }
+/*
+ * Replay of the last response. The response stays in its transmit slot until the slot is
+ * used again, which is two responses later, so it is not copied when it is sent.
+ */
+static const BusFrame *last_rsp = NULL;     // NULL when the slot has been reused
 
-        case CMD_GET_ALL: {
-            /*
-             * Get all the measurement data (mainly for testing purposes)
-             */
+// The last response answered a sequenced request with last_seq from last_seq_src
+static uint8_t last_seq_valid = 0;
+static uint8_t last_seq, last_seq_src;
 
-            rsp->cmd = RSP_ALL;
+#ifdef BUS_MASTERING_API
 
-            if(sleep_mode){
-                wakeup();
-            }
+// Subscription to the position telemetry, period 0 when there is none
+static uint16_t subscription_period = 0;
+static uint8_t subscriber;
+static timestamp_t subscription_time;
 
-            // Get temperature
-            int temp = read_tempC();
-            memcpy(rsp->data, &temp, sizeof(temp));
+int subscription_due(void) {
+    if (subscription_period == 0)
+        return 0;
+    return (timestamp_t)(get_timestamp() - subscription_time) >= subscription_period;
+}
 
-            // Get angles
-            if (!SAMPLE_SENSOR()){
-                respond_with_status_code(rsp, RSP_STATUS_SAMPLING_ERROR);
-                break;
-            }
+void subscription_publish(BusFrame* frame) {
+    subscription_time = get_timestamp();
 
-            uint32_t VALUE_X = 0, VALUE_Y = 0;
+    // Keep the sensor awake while someone is listening
+    reset_idle_counter();
 
-            // Rolling filter checks if the sensor is saturated or not. If not perform quadratic middle calculation, if yes estimate with calc_middle
-            rolling_filter(x_data, filtered_arr);
-            if (quadratic_middle(filtered_arr, 'x') != CALC_OK) {
-                respond_with_status_code(rsp, RSP_STATUS_CALC_ERROR);
-                break;
-            }
+    frame->dst = subscriber;
 
-            // Rolling filter checks if the sensor is saturated or not. If not perform quadratic middle calculation, if yes estimate with calc_middle
-            rolling_filter(y_data, filtered_arr);
-            if (quadratic_middle(filtered_arr, 'y') != CALC_OK) {
-                respond_with_status_code(rsp, RSP_STATUS_CALC_ERROR);
-                break;
-            }
+    // The slot of the last response is reused
+    if (frame == last_rsp) {
+        last_rsp = NULL;
+        last_seq_valid = 0;
+    }
 
-            VALUE_X = angle(VALUE_X + X_BIAS);                   // Correct for X_BIAS
-            VALUE_Y = angle(VALUE_Y + Y_BIAS);                   // Correct for Y_BIAS
+    SensorResult res;
+    if (!measure(&res, frame, CMD_AWAKE)) return;
 
+    frame->cmd = RSP_POSITION;
+    frame->len = put_position(frame->data, &res);
+}
 
-            memcpy(rsp->data + sizeof(temp), &VALUE_X, sizeof(VALUE_X));
-            memcpy(rsp->data + sizeof(temp) + sizeof(VALUE_X), &VALUE_Y, sizeof(VALUE_Y));
-            memcpy(rsp->data + sizeof(temp) + sizeof(VALUE_X) + sizeof(VALUE_Y), &SNR_X, sizeof(SNR_X));
-            memcpy(rsp->data + sizeof(temp) + sizeof(VALUE_X) + sizeof(VALUE_Y) + sizeof(SNR_X), &SNR_Y, sizeof(SNR_Y));
+#endif /* BUS_MASTERING_API */
 
-            rsp->len = sizeof(temp)+sizeof(VALUE_X)+sizeof(VALUE_Y)+sizeof(SNR_X)+sizeof(SNR_X);
+////////////////////////////////////////////////////////////////////////////////
+/// Command handlers
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * The handlers are called from the command table after the data length has been checked
+ * and the sensor has been woken up as the flags of the command tell. The measurement is
+ * valid only for the commands with CMD_MEASURE.
+ */
+typedef void (*CommandHandler)(const BusFrame *cmd, BusFrame *rsp, const SensorResult *res);
+
+static void cmd_get_status(const BusFrame *cmd, BusFrame *rsp, const SensorResult *res) {
+    /*
+     * General status/test command
+     */
+
+    respond_with_status_code(rsp, sleep_mode ? RSP_STATUS_SLEEP : RSP_STATUS_OK);
+}
 
-            // Get raw
-            //memcpy(transmit_message + 1, x_data, sizeof(x_data));
-            //memcpy(transmit_message + 257, y_data, sizeof(y_data));
+static void cmd_get_raw(const BusFrame *cmd, BusFrame *rsp, const SensorResult *res) {
+    /*
+     * DOES NOT SAMPLE SENSOR
+     * Get raw current measurements
+     */
+
+    // Part number 0-1 for the halves of the X profile and 2-3 for the Y profile
+    uint8_t part = cmd->data[0];
+    if (part > RAW_PART_PACKED_Y) {
+        respond_with_status_code(rsp, RSP_STATUS_INVALID_PARAM);
+        return;
+    }
 
-            // Set length of message to be transmitted
-            //rsp->len = sizeof(x_data) + sizeof(y_data) + 14;
-            break;
+    if (part >= RAW_PART_PACKED) {
+        uint16_t len = raw_pack(part != RAW_PART_PACKED_Y ? x_data : NULL,
+                                part != RAW_PART_PACKED_X ? y_data : NULL,
+                                rsp->data + 1, BUS_DATA_MAX - 1);
+        if (len == 0) {
+            // Too noisy, the master falls back to the smaller parts
+            respond_with_status_code(rsp, RSP_STATUS_ERROR);
+            return;
         }
-#endif
 
-        case CMD_GET_TEMPERATURE: {
-            /*
-             * Return MCU temperature reading
-             */
+        rsp->data[0] = part;
+        rsp->cmd = RSP_RAW;
+        rsp->len = len + 1;
+        return;
+    }
 
-            int16_t temp = read_tempC();
+    const uint8_t *profile = (part < 2) ? x_data : y_data;
 
-            rsp->cmd = RSP_TEMPERATURE;
-            memcpy(rsp->data, &temp, sizeof(temp));
+    // respond with the part number first
+    rsp->data[0] = part;
+    memcpy(rsp->data+1, profile + (part & 1) * 128, sizeof(uint8_t)*128);
 
-            rsp->len = sizeof(temp);
-            break;
-        }
+    // Length (x_data/2) = 128
+    rsp->cmd = RSP_RAW;
+    rsp->len = 128+1;
+}
 
-        case CMD_GET_CONFIG: {
+// Window of width pixels around the peak, moved inside the profile at the edges
+static uint16_t put_roi(uint8_t *dst, const uint8_t *profile, uint8_t peak, int16_t value, uint8_t width) {
+    uint8_t start = (peak > width / 2) ? peak - width / 2 : 0;
+    if (start > RAWPACK_PIXELS - width)
+        start = RAWPACK_PIXELS - width;
 
-            switch(cmd->data[0]) {
-                case CMD_CONFIG_CALIBRATION: {
-                    /*
-                     * Get the sensor bias values for the X, Y and Z center position of the light spot
-                     * Also get Temp bias
-                     */
+    dst[0] = start;
+    memcpy(dst + 1, &value, sizeof(value));
+    memcpy(dst + 1 + sizeof(value), profile + start, width);
 
-                    rsp->cmd = RSP_CONFIG;
-                    rsp->data[0] = CMD_CONFIG_CALIBRATION;
-                    memcpy(rsp->data+1, &X_BIAS, sizeof(X_BIAS));
-                    memcpy(rsp->data+1 + sizeof(X_BIAS), &Y_BIAS, sizeof(Y_BIAS));
-                    memcpy(rsp->data+1 + sizeof(X_BIAS) + sizeof(Y_BIAS), &VALUE_Z, sizeof(VALUE_Z));
-                    memcpy(rsp->data+1 + sizeof(X_BIAS) + sizeof(Y_BIAS) + sizeof(VALUE_Z), &TEMPERATURE_BIAS, sizeof(TEMPERATURE_BIAS));
+    return 1 + sizeof(value) + width;
+}
 
-                    rsp->len = sizeof(X_BIAS)+sizeof(Y_BIAS)+sizeof(VALUE_Z)+sizeof(TEMPERATURE_BIAS)+1;
+static void cmd_get_roi(const BusFrame *cmd, BusFrame *rsp, const SensorResult *res) {
+    /*
+     * Get the raw pixels around the light spot on both axes
+     * The measured frame is the latest one in x_data/y_data.
+     */
 
-                    break;
-                }
+    uint8_t width = (cmd->len == 1) ? cmd->data[0] : ROI_WIDTH_DEFAULT;
+    if (width == 0 || width > ROI_WIDTH_MAX) {
+        respond_with_status_code(rsp, RSP_STATUS_INVALID_PARAM);
+        return;
+    }
+
+    uint16_t len = 0;
+    rsp->data[len++] = width;
+    len += put_roi(rsp->data + len, x_data, res->peak_x, res->value_x, width);
+    len += put_roi(rsp->data + len, y_data, res->peak_y, res->value_y, width);
 
-                case CMD_CONFIG_SAT_LEVEL: {
-                    /*
-                     * Get Sensor saturation level calibration value
-                     */
+    rsp->cmd = RSP_ROI;
+    rsp->len = len + append_frame_info(rsp->data + len, res);
+}
 
-                    rsp->cmd = RSP_CONFIG;
-                    rsp->data[0] = CMD_CONFIG_SAT_LEVEL;
-                    memcpy(rsp->data+1, &SAT_LEVEL, sizeof(SAT_LEVEL));
+static void cmd_get_position(const BusFrame *cmd, BusFrame *rsp, const SensorResult *res) {
+    /*
+     * Get position of the light spot
+     */
 
-                    rsp->len = sizeof(SAT_LEVEL)+1;
-                    break;
-                }
+    rsp->cmd = RSP_POSITION;
+    rsp->len = put_position(rsp->data, res);
+}
 
-                case CMD_CONFIG_INT: {
-                    /*
-                     * Get Sensor integration time variable
-                     */
+static void cmd_get_vector(const BusFrame *cmd, BusFrame *rsp, const SensorResult *res) {
+    /*
+     * This function returns a vector in the format [x_value, y_value, z_value, SNR_X, SNR_Y]
+     */
 
-                    rsp->cmd = RSP_CONFIG;
-                    rsp->data[0] = CMD_CONFIG_INT;
-                    memcpy(rsp->data+1, &INT_TIME, sizeof(INT_TIME));
+    rsp->cmd = RSP_VECTOR;
+    rsp->len = put_vector(rsp->data, res);
+}
 
-                    rsp->len = sizeof(INT_TIME)+1;
-                    break;
-                }
+static void cmd_get_sun_vector(const BusFrame *cmd, BusFrame *rsp, const SensorResult *res) {
+    /*
+     * This function returns the normalized sun vector in the format [x, y, z, azimuth, elevation, SNR_X, SNR_Y]
+     * The components are Q15 and the angles centidegrees
+     */
 
-                case CMD_CONFIG_SAMPLING: {
-                    /*
-                     * Get Sensor sampling time variable
-                     */
+    SunVector vec;
+    if (sun_vector(res, &vec) != CALC_OK) {
+        respond_with_status_code(rsp, RSP_STATUS_CALC_ERROR);
+        return;
+    }
+
+    rsp->cmd = RSP_SUN_VECTOR;
+    rsp->len = put_sun_vector(rsp->data, &vec, res);
+}
 
-                    rsp->cmd = RSP_CONFIG;
-                    rsp->data[0] = CMD_CONFIG_SAMPLING;
-                    memcpy(rsp->data+1, &SAMPLING_TIME, sizeof(SAMPLING_TIME));
+static void cmd_get_angles(const BusFrame *cmd, BusFrame *rsp, const SensorResult *res) {
+    /*
+     * Get sun angle
+     */
 
-                    rsp->len = sizeof(SAMPLING_TIME)+1;
-                    break;
-                }
+    int16_t angle_x, angle_y;
+    if (get_angles(res, &angle_x, &angle_y) != CALC_OK) {
+        respond_with_status_code(rsp, RSP_STATUS_CALC_ERROR);
+        return;
+    }
 
-                case CMD_CONFIG_GAIN: {
-                    /*
-                     * Get Sensor GAIN variable
-                     */
+    rsp->cmd = RSP_ANGLES;
+    rsp->len = put_angles(rsp->data, angle_x, angle_y, res);
+}
 
-                    rsp->cmd = RSP_CONFIG;
-                    rsp->data[0] = CMD_CONFIG_GAIN;
-                    memcpy(rsp->data +1, &GAIN, sizeof(GAIN));
+static void cmd_get_all(const BusFrame *cmd, BusFrame *rsp, const SensorResult *res) {
+    /*
+     * Get all the measurement data (mainly for testing purposes)
+     */
 
-                    rsp->len = sizeof(GAIN)+1;
+    // Get angles
+    int16_t angle_x, angle_y;
+    if (get_angles(res, &angle_x, &angle_y) != CALC_OK) {
+        respond_with_status_code(rsp, RSP_STATUS_CALC_ERROR);
+        return;
+    }
 
-                    break;
-                }
-                default:
-                    /* Unknown command */
-                    respond_with_status_code(rsp, RSP_STATUS_UNKNOWN_COMMAND);
-                    break;
-            }
+    rsp->cmd = RSP_ALL;
+
+    // Get temperature
+    int temp = read_tempC();
+    memcpy(rsp->data, &temp, sizeof(temp));
+
+    memcpy(rsp->data + sizeof(temp), &angle_x, sizeof(angle_x));
+    memcpy(rsp->data + sizeof(temp) + sizeof(angle_x), &angle_y, sizeof(angle_y));
+    memcpy(rsp->data + sizeof(temp) + sizeof(angle_x) + sizeof(angle_y), &res->snr_x, sizeof(res->snr_x));
+    memcpy(rsp->data + sizeof(temp) + sizeof(angle_x) + sizeof(angle_y) + sizeof(res->snr_x), &res->snr_y, sizeof(res->snr_y));
+
+    rsp->len = sizeof(temp)+sizeof(angle_x)+sizeof(angle_y)+sizeof(res->snr_x)+sizeof(res->snr_y);
+    rsp->len += append_frame_info(rsp->data + rsp->len, res);
+}
 
-            break;
+static void cmd_get_temperature(const BusFrame *cmd, BusFrame *rsp, const SensorResult *res) {
+    /*
+     * Return MCU temperature reading
+     */
+
+    int16_t temp = read_tempC();
+
+    rsp->cmd = RSP_TEMPERATURE;
+    memcpy(rsp->data, &temp, sizeof(temp));
+
+    rsp->len = sizeof(temp);
+}
+
+static void cmd_get_batch(const BusFrame *cmd, BusFrame *rsp, const SensorResult *res) {
+    /*
+     * Several commands in one request and one response sharing one sample
+     */
+
+    handle_batch(cmd, rsp);
+}
+
+static void cmd_trigger(const BusFrame *cmd, BusFrame *rsp, const SensorResult *res) {
+    /*
+     * Start a measurement in the background and return right away
+     * with the ticket of the measurement and the ETA in ms
+     */
+
+    uint16_t ticket = acquisition_trigger();
+    uint16_t eta = acquisition_eta();
+
+    rsp->cmd = RSP_TRIGGER;
+    memcpy(rsp->data, &ticket, sizeof(ticket));
+    memcpy(rsp->data + sizeof(ticket), &eta, sizeof(eta));
+
+    rsp->len = sizeof(ticket)+sizeof(eta);
+}
+
+static void cmd_fetch(const BusFrame *cmd, BusFrame *rsp, const SensorResult *res) {
+    /*
+     * Get the result of a triggered measurement in the format [ticket, position]
+     * The position is the same as in RSP_POSITION.
+     */
+
+    uint16_t ticket;
+    SensorResult fetched;
+
+    memcpy(&ticket, cmd->data, sizeof(ticket));
+
+    uint8_t state = acquisition_fetch(ticket, &fetched);
+    if (state == TRIGGER_UNKNOWN) {
+        // A sensor put to sleep has not measured anything since
+        respond_with_status_code(rsp, sleep_mode ? RSP_STATUS_SLEEP : RSP_STATUS_INVALID_PARAM);
+        return;
+    }
+    if (state == TRIGGER_PENDING) {
+        uint16_t eta = acquisition_eta();
+
+        respond_with_status_code(rsp, RSP_STATUS_NOT_READY);
+        memcpy(rsp->data + 1, &eta, sizeof(eta));
+        rsp->len += sizeof(eta);
+        return;
+    }
+    if (fetched.status == SAMPLING_ERROR) {
+        respond_with_status_code(rsp, RSP_STATUS_SAMPLING_ERROR);
+        return;
+    }
+    if (fetched.status != CALC_OK) {
+        respond_with_status_code(rsp, RSP_STATUS_CALC_ERROR);
+        return;
+    }
+
+    rsp->cmd = RSP_FETCH;
+    memcpy(rsp->data, &ticket, sizeof(ticket));
+    rsp->len = sizeof(ticket);
+    rsp->len += put_position(rsp->data + rsp->len, &fetched);
+}
+
+static void cmd_burst_start(const BusFrame *cmd, BusFrame *rsp, const SensorResult *res) {
+    /*
+     * Capture the next frames into the burst buffer
+     */
+
+    uint8_t count = cmd->data[0];
+    if (count == 0 || count > BURST_FRAMES) {
+        respond_with_status_code(rsp, RSP_STATUS_INVALID_PARAM);
+        return;
+    }
+
+    burst_start(count);
+    respond_with_status_code(rsp, RSP_STATUS_OK);
+}
+
+static void cmd_burst_read(const BusFrame *cmd, BusFrame *rsp, const SensorResult *res) {
+    /*
+     * DOES NOT SAMPLE SENSOR
+     * Get a page of a frame captured in the latest burst
+     */
+
+    uint8_t index = cmd->data[0];
+    uint8_t page = cmd->data[1];
+    uint16_t offset = (uint16_t)page * BURST_PAGE_SIZE;
+
+    if (index >= burst_length() || offset >= sizeof(BurstFrame)) {
+        respond_with_status_code(rsp, RSP_STATUS_INVALID_PARAM);
+        return;
+    }
+
+    const BurstFrame *frame = burst_frame(index);
+    if (frame == NULL) {
+        uint16_t eta = burst_eta(index);
+        if (eta == 0) {
+            respond_with_status_code(rsp, RSP_STATUS_ERROR);
+            return;
         }
 
-        case CMD_SET_CONFIG: {
+        respond_with_status_code(rsp, RSP_STATUS_NOT_READY);
+        memcpy(rsp->data + 1, &eta, sizeof(eta));
+        rsp->len += sizeof(eta);
+        return;
+    }
 
-            switch(cmd->data[0]) {
-                case CMD_CONFIG_CALIBRATION: {
-                    /*
-                     * Set the sensor bias values for the X and Y center position of the light spot
-                     */
+    uint16_t len = sizeof(BurstFrame) - offset;
+    if (len > BURST_PAGE_SIZE)
+        len = BURST_PAGE_SIZE;
 
-                    if (cmd->len != 9){
-                        respond_with_status_code(rsp, RSP_STATUS_INVALID_PARAM);
-                        break;
-                    }
+    rsp->data[0] = index;
+    rsp->data[1] = page;
+    memcpy(rsp->data + 2, (const uint8_t *)frame + offset, len);
 
-                    memcpy(&X_BIAS, cmd->data + 1, sizeof(X_BIAS));
-                    memcpy(&Y_BIAS, cmd->data + 3, sizeof(Y_BIAS));
-                    memcpy(&VALUE_Z, cmd->data + 5, sizeof(VALUE_Z));
-                    memcpy(&TEMPERATURE_BIAS, cmd->data + 7, sizeof(TEMPERATURE_BIAS));
+    rsp->cmd = RSP_BURST;
+    rsp->len = len + 2;
+}
 
-                    respond_with_status_code(rsp,RSP_STATUS_OK);
-                    break;
-                }
+static void cmd_sync_trigger(const BusFrame *cmd, BusFrame *rsp, const SensorResult *res) {
+    /*
+     * Synchronous trigger addressed to this sensor only (for testing)
+     * The measurement was started by the bus receive interrupt. The ticket is the trigger ID.
+     */
 
-                case CMD_CONFIG_SAT_LEVEL: {
-                    /*
-                     * Set sensor saturation level calibration value
-                     */
+    uint16_t ticket;
+    memcpy(&ticket, cmd->data, sizeof(ticket));
 
-                    memcpy(&SAT_LEVEL, cmd->data + 1, sizeof(SAT_LEVEL));
+    uint16_t eta = acquisition_eta();
 
-                    respond_with_status_code(rsp,RSP_STATUS_OK);
+    rsp->cmd = RSP_TRIGGER;
+    memcpy(rsp->data, &ticket, sizeof(ticket));
+    memcpy(rsp->data + sizeof(ticket), &eta, sizeof(eta));
 
-                    break;
-                }
+    rsp->len = sizeof(ticket)+sizeof(eta);
+}
 
-                case CMD_CONFIG_INT: {
-                    /*
-                     * Set the integration time of the sensor. This is a uint16_t value.
-                     */
+#ifdef BUS_MASTERING_API
+static void cmd_subscribe(const BusFrame *cmd, BusFrame *rsp, const SensorResult *res) {
+    /*
+     * Subscribe to the position telemetry every period ms (uint16), 0 to unsubscribe
+     * The sensor publishes RSP_POSITION frames to the sender when the bus is free.
+     */
 
-                    if (cmd->len != 3){
-                        respond_with_status_code(rsp, RSP_STATUS_INVALID_PARAM);
-                        break;
-                    }
+    uint16_t period;
+    memcpy(&period, cmd->data, sizeof(period));
 
-                    uint16_t temp_int_time;
+    if (period != 0 && period < SUBSCRIPTION_MIN_PERIOD) {
+        respond_with_status_code(rsp, RSP_STATUS_INVALID_PARAM);
+        return;
+    }
 
-                    memcpy(&temp_int_time, cmd->data + 1, sizeof(temp_int_time));
+    subscriber = cmd->src;
+    subscription_period = period;
+    subscription_time = get_timestamp();
 
-                    // Prevent user from setting a too low integration time
-                    if (temp_int_time < 3200) {
-                        respond_with_status_code(rsp, RSP_STATUS_INVALID_PARAM);
-                        break;
-                    }
+    respond_with_status_code(rsp,RSP_STATUS_OK);
+}
+#endif
 
-                    INT_TIME = temp_int_time;
+static void cmd_get_timing(const BusFrame *cmd, BusFrame *rsp, const SensorResult *res);
 
-                    respond_with_status_code(rsp,RSP_STATUS_OK);
-                    break;
-                }
+// Respond with the last response again. Returns 0 if there is nothing to repeat.
+static int repeat_last(BusFrame *rsp) {
+    if (last_rsp == NULL)
+        return 0;
 
-                case CMD_CONFIG_SAMPLING: {
-                    /*
-                     * Set the sensor sampling time. Setting a sampling value of less than 3100, use at your own risk. The sampling period should be over 3000.
-                     * Anything less than this might result in unpredicted behavior of the DSS.
-                     */
+    if (rsp != last_rsp) {
+        rsp->cmd = last_rsp->cmd;
+        rsp->len = last_rsp->len;
+        memcpy(rsp->data, last_rsp->data, last_rsp->len);
+    }
+    return 1;
+}
 
-                    if (cmd->len != 3){
-                        respond_with_status_code(rsp, RSP_STATUS_INVALID_PARAM);
-                        break;
-                    }
+static void cmd_repeat_last(const BusFrame *cmd, BusFrame *rsp, const SensorResult *res) {
+    /*
+     * Send the last response again without handling its command again, e.g. after a CRC error
+     */
 
-                    uint16_t temp_sampling_time;
+    if (!repeat_last(rsp))
+        respond_with_status_code(rsp, RSP_STATUS_ERROR);
+}
 
-                    memcpy(&temp_sampling_time, cmd->data + 1, sizeof(temp_sampling_time));
+static void cmd_get_stats(const BusFrame *cmd, BusFrame *rsp, const SensorResult *res) {
+    /*
+     * Get the bus, pipeline and power counters and the command service latency histogram
+     */
+
+    BusStats bus;
+    uint32_t latency[BUS_LATENCY_BINS];
+    uint16_t len = 0;
+
+    bus_stats(&bus, latency);
+
+    memcpy(rsp->data + len, &bus, sizeof(bus));
+    len += sizeof(bus);
+    memcpy(rsp->data + len, &pipeline_stats, sizeof(pipeline_stats));
+    len += sizeof(pipeline_stats);
+    memcpy(rsp->data + len, &sleep_count, sizeof(sleep_count));
+    len += sizeof(sleep_count);
+    memcpy(rsp->data + len, &wakeup_count, sizeof(wakeup_count));
+    len += sizeof(wakeup_count);
+    memcpy(rsp->data + len, latency, sizeof(latency));
+    len += sizeof(latency);
+
+    rsp->cmd = RSP_STATS;
+    rsp->len = len;
+}
 
-                    // Prevent user from setting a too low sampling time
-                    if (temp_sampling_time < 3200) {
-                        respond_with_status_code(rsp, RSP_STATUS_INVALID_PARAM);
-                        break;
-                    }
+static void cmd_get_config(const BusFrame *cmd, BusFrame *rsp, const SensorResult *res) {
 
-                    SAMPLING_TIME = temp_sampling_time;
+    uint16_t len = get_config(cmd->data[0], rsp->data);
+    if (len == 0) {
+        /* Unknown command */
+        respond_with_status_code(rsp, RSP_STATUS_UNKNOWN_COMMAND);
+        return;
+    }
 
-                    respond_with_status_code(rsp,RSP_STATUS_OK);
-                    break;
-                }
+    rsp->cmd = RSP_CONFIG;
+    rsp->len = len;
+}
 
-                case CMD_CONFIG_GAIN: {
-                    /*
-                     * Set the profile sensors gain --> High gain = 1 and Low gain = 0
-                     */
+static void cmd_set_config(const BusFrame *cmd, BusFrame *rsp, const SensorResult *res) {
 
-                    //received_message[2] contains new gain setting (0 or 1)
-                    // Set Profile Sensor Gain
-                    if ((cmd->data[1] != 0x00) && (cmd->data[1] != 0x01)){
-                        respond_with_status_code(rsp, RSP_STATUS_INVALID_PARAM);
-                        break;
-                    }
+    const ConfigEntry *entry = find_config(cmd->data[0]);
+    if (entry == NULL) {
+        /* Unknown command */
+        respond_with_status_code(rsp, RSP_STATUS_UNKNOWN_COMMAND);
+        return;
+    }
 
-                    GAIN = cmd->data[1];
-                    ss_gain(GAIN);
+    if (cmd->len != entry->set_len + 1) {
+        respond_with_status_code(rsp, RSP_STATUS_INVALID_PARAM);
+        return;
+    }
 
-                    respond_with_status_code(rsp,RSP_STATUS_OK);
-                    break;
-                }
+    respond_with_status_code(rsp, entry->set(cmd->data + 1));
+}
 
-                default:
-                    /* Unknown command */
-                    respond_with_status_code(rsp, RSP_STATUS_UNKNOWN_COMMAND);
-                    break;
-            }
-            break;
+////////////////////////////////////////////////////////////////////////////////
+/// Command table
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+    CommandHandler handler;
+    uint16_t min_len;                   // Accepted lengths of the command data
+    uint16_t max_len;
+    uint8_t flags;
+} Command;
+
+/*
+ * The commands are looked up by the high nibble of the code for the group and the
+ * low nibble for the command in the group.
+ */
+#define COMMAND_GROUP(code) ((code) >> 4)
+#define COMMAND_INDEX(code) ((code) & 0x0F)
+
+static const Command sensor_commands[16] = {
+    [COMMAND_INDEX(CMD_GET_STATUS)]      = { cmd_get_status,      0, 0, 0 },
+    [COMMAND_INDEX(CMD_GET_RAW)]         = { cmd_get_raw,         1, 1, 0 },
+    [COMMAND_INDEX(CMD_GET_POSITION)]    = { cmd_get_position,    0, 0, CMD_AWAKE | CMD_MEASURE },
+    [COMMAND_INDEX(CMD_GET_VECTOR)]      = { cmd_get_vector,      0, 0, CMD_AWAKE | CMD_MEASURE },
+    [COMMAND_INDEX(CMD_GET_ANGLES)]      = { cmd_get_angles,      0, 0, CMD_WAKE | CMD_MEASURE },
+    [COMMAND_INDEX(CMD_GET_ALL)]         = { cmd_get_all,         0, 0, CMD_WAKE | CMD_MEASURE },
+    [COMMAND_INDEX(CMD_GET_TEMPERATURE)] = { cmd_get_temperature, 0, 0, 0 },
+    [COMMAND_INDEX(CMD_GET_SUN_VECTOR)]  = { cmd_get_sun_vector,  0, 0, CMD_AWAKE | CMD_MEASURE },
+    [COMMAND_INDEX(CMD_GET_BATCH)]       = { cmd_get_batch,       1, BUS_DATA_MAX, 0 },
+    [COMMAND_INDEX(CMD_TRIGGER)]         = { cmd_trigger,         0, 0, CMD_AWAKE },
+    [COMMAND_INDEX(CMD_FETCH)]           = { cmd_fetch,           2, 2, 0 },
+    [COMMAND_INDEX(CMD_SYNC_TRIGGER)]    = { cmd_sync_trigger,    2, 2, CMD_AWAKE },
+#ifdef BUS_MASTERING_API
+    [COMMAND_INDEX(CMD_SUBSCRIBE)]       = { cmd_subscribe,       2, 2, 0 },
+#endif
+    [COMMAND_INDEX(CMD_GET_TIMING)]      = { cmd_get_timing,      0, 1, 0 },
+    [COMMAND_INDEX(CMD_GET_STATS)]       = { cmd_get_stats,       0, 0, 0 },
+};
+
+// The last command of a group sets its size
+#define GROUP_SIZE(last)    (COMMAND_INDEX(last) + 1)
+
+static const Command config_commands[GROUP_SIZE(CMD_SET_CONFIG)] = {
+    [COMMAND_INDEX(CMD_GET_CONFIG)]      = { cmd_get_config,      1, 1, 0 },
+    [COMMAND_INDEX(CMD_SET_CONFIG)]      = { cmd_set_config,      2, 9, 0 },
+};
+
+static const Command link_commands[GROUP_SIZE(CMD_REPEAT_LAST)] = {
+    [COMMAND_INDEX(CMD_REPEAT_LAST)]     = { cmd_repeat_last,     0, 0, 0 },
+};
+
+static const Command raw_commands[GROUP_SIZE(CMD_BURST_READ)] = {
+    [COMMAND_INDEX(CMD_GET_ROI)]         = { cmd_get_roi,         0, 1, CMD_AWAKE | CMD_MEASURE },
+    [COMMAND_INDEX(CMD_BURST_START)]     = { cmd_burst_start,     1, 1, CMD_AWAKE },
+    [COMMAND_INDEX(CMD_BURST_READ)]      = { cmd_burst_read,      2, 2, 0 },
+};
+
+// Handling times of the commands in stopwatch ticks
+typedef struct {
+    uint16_t count;
+    uint32_t total;
+    uint32_t max;
+} CommandTiming;
+
+#pragma SET_DATA_SECTION(".fram_vars")
+// Kept over resets, zeroed when the firmware is loaded
+static CommandTiming sensor_timing[16] = {{0}};
+static CommandTiming config_timing[GROUP_SIZE(CMD_SET_CONFIG)] = {{0}};
+static CommandTiming link_timing[GROUP_SIZE(CMD_REPEAT_LAST)] = {{0}};
+static CommandTiming raw_timing[GROUP_SIZE(CMD_BURST_READ)] = {{0}};
+#pragma SET_DATA_SECTION()
+
+typedef struct {
+    const Command *commands;
+    CommandTiming *timing;
+    uint8_t size;
+} CommandGroup;
+
+static const CommandGroup command_groups[16] = {
+    [COMMAND_GROUP(CMD_GET_STATUS)]  = { sensor_commands, sensor_timing, 16 },
+    [COMMAND_GROUP(CMD_REPEAT_LAST)] = { link_commands,   link_timing,   GROUP_SIZE(CMD_REPEAT_LAST) },
+    [COMMAND_GROUP(CMD_GET_ROI)]     = { raw_commands,    raw_timing,    GROUP_SIZE(CMD_BURST_READ) },
+    [COMMAND_GROUP(CMD_GET_CONFIG)]  = { config_commands, config_timing, GROUP_SIZE(CMD_SET_CONFIG) },
+};
+
+static const Command* find_command(uint8_t code) {
+    const CommandGroup *group = &command_groups[COMMAND_GROUP(code)];
+    if (COMMAND_INDEX(code) >= group->size)
+        return NULL;
+
+    const Command *entry = &group->commands[COMMAND_INDEX(code)];
+    return entry->handler != NULL ? entry : NULL;
+}
+
+static CommandTiming* find_timing(uint8_t code) {
+    return &command_groups[COMMAND_GROUP(code)].timing[COMMAND_INDEX(code)];
+}
+
+static void cmd_get_timing(const BusFrame *cmd, BusFrame *rsp, const SensorResult *res) {
+    /*
+     * Get the handling times of the commands as [code, count, total, max] entries
+     * The times are in stopwatch ticks. The timing is cleared after reading if the data is 1.
+     */
+
+    uint16_t len = 0;
+    unsigned int group, i;
+
+    if (cmd->len == 1 && cmd->data[0] > 1) {
+        respond_with_status_code(rsp, RSP_STATUS_INVALID_PARAM);
+        return;
+    }
+
+    for (group = 0; group < 16; group++) {
+        for (i = 0; i < command_groups[group].size; i++) {
+            uint8_t code = (group << 4) | i;
+            if (find_command(code) == NULL)
+                continue;
+
+            CommandTiming *timing = find_timing(code);
+
+            rsp->data[len] = code;
+            memcpy(rsp->data + len + 1, &timing->count, sizeof(timing->count));
+            memcpy(rsp->data + len + 3, &timing->total, sizeof(timing->total));
+            memcpy(rsp->data + len + 7, &timing->max, sizeof(timing->max));
+            len += TIMING_ENTRY_SIZE;
+
+            if (cmd->len == 1 && cmd->data[0] == 1)
+                memset(timing, 0, sizeof(*timing));
         }
+    }
+
+    rsp->cmd = RSP_TIMING;
+    rsp->len = len;
+}
+
+/*
+ * Run a command from the table and record its handling time
+ */
+static void dispatch(const Command *entry, const BusFrame *cmd, BusFrame *rsp) {
+    SensorResult res;
+    stopwatch_t sw;
 
-        default:
-            /* Unknown command */
-            respond_with_status_code(rsp, RSP_STATUS_UNKNOWN_COMMAND);
-            break;
+    stopwatch_start(&sw);
+
+    if (entry->flags & CMD_MEASURE) {
+        if (measure(&res, rsp, entry->flags))
+            entry->handler(cmd, rsp, &res);
+    }
+    else {
+        uint8_t status = wake(entry->flags);
+        if (status == RSP_STATUS_OK)
+            entry->handler(cmd, rsp, NULL);
+        else
+            respond_with_status_code(rsp, status);
+    }
+
+    uint32_t elapsed = stopwatch_elapsed(&sw);
+    CommandTiming *timing = find_timing(cmd->cmd);
+
+    timing->count++;
+    timing->total += elapsed;
+    if (elapsed > timing->max)
+        timing->max = elapsed;
+}
+
+/*
+ * Look up a command and run it
+ */
+static void run_command(const BusFrame *cmd, BusFrame *rsp) {
+    const Command *entry = find_command(cmd->cmd);
+    if (entry == NULL) {
+        /* Unknown command */
+        respond_with_status_code(rsp, RSP_STATUS_UNKNOWN_COMMAND);
+    }
+    else if (cmd->len < entry->min_len || cmd->len > entry->max_len) {
+        respond_with_status_code(rsp, RSP_STATUS_INVALID_PARAM);
+    }
+    else {
+        dispatch(entry, cmd, rsp);
+    }
+}
+
+/*
+ * Unwrap a sequenced request in place. Returns 1 if it repeats the previous one
+ * from the same master, which is answered from the cache.
+ */
+static int unwrap_sequenced(BusFrame *cmd, uint8_t *seq) {
+    *seq = cmd->data[0];
+
+    if (last_seq_valid && last_rsp != NULL && *seq == last_seq && cmd->src == last_seq_src)
+        return 1;
+
+    cmd->cmd = cmd->data[1];
+    cmd->len -= 2;
+    memmove(cmd->data, cmd->data + 2, cmd->len);
+    return 0;
+}
+
+int handle_command(BusFrame* cmd, BusFrame* rsp) {
+    // Stop the HB timer during command handling
+    //HB_TIMER_DISABLE();
+
+    // Broadcasts are never answered. Only the synchronous trigger is acted on,
+    // the bus receive interrupt has already started its measurement if the sensor was awake.
+    if (cmd->dst == BUS_ADDRESS_BROADCAST) {
+        if (cmd->cmd == CMD_SYNC_TRIGGER && cmd->len == 2) {
+            if (sleep_mode) {
+                // Start it now, late by the wakeup and the command handling
+                uint16_t id;
+                memcpy(&id, cmd->data, sizeof(id));
+
+                wakeup();
+                __disable_interrupt();
+                acquisition_sync(id);
+                __enable_interrupt();
+            }
+            reset_idle_counter();
         }
+        return 0;
+    }
+
+	rsp->dst = cmd->src;
+
+	int sequenced = 0;
+	uint8_t seq = 0;
+
+	if (cmd->cmd != CMD_SEQUENCED) {
+	    run_command(cmd, rsp);
+	}
+	else if (cmd->len < 2 || cmd->data[1] == CMD_SEQUENCED) {
+	    respond_with_status_code(rsp, RSP_STATUS_INVALID_PARAM);
+	}
+	else if (unwrap_sequenced(cmd, &seq)) {
+	    // A retry of the previous request, answer from the cache
+	    repeat_last(rsp);
+	    reset_idle_counter();
+	    return 1;
+	}
+	else {
+	    run_command(cmd, rsp);
+	    sequenced = 1;
+	}
+
+	// Keep the response for a replay. A repeated response still answers the same request.
+	if (cmd->cmd != CMD_REPEAT_LAST || sequenced) {
+	    last_seq_valid = sequenced;
+	    last_seq = seq;
+	    last_seq_src = cmd->src;
+	}
+	last_rsp = rsp;
 
 	// Command handled - Reset flags
 	reset_idle_counter();
@@ -499,4 +1290,5 @@ void handle_command(const BusFrame* cmd, BusFrame* rsp) {
     // Start the HB timer
     //HB_TIMER_ENABLE();
 
+    return 1;
 }
@@ -11,6 +11,19 @@
 #define CMD_GET_ANGLES          0x05
 #define CMD_GET_ALL             0x06
 #define CMD_GET_TEMPERATURE     0x07
+#define CMD_GET_SUN_VECTOR      0x08
+#define CMD_GET_BATCH           0x09
+#define CMD_TRIGGER             0x0A
+#define CMD_FETCH               0x0B
+#define CMD_SYNC_TRIGGER        0x0C
+#define CMD_SUBSCRIBE           0x0D
+#define CMD_GET_TIMING          0x0E
+#define CMD_GET_STATS           0x0F
+#define CMD_REPEAT_LAST         0x10
+#define CMD_SEQUENCED           0x11
+#define CMD_GET_ROI             0x20
+#define CMD_BURST_START         0x21
+#define CMD_BURST_READ          0x22
 // GET/SET Config commands
 #define CMD_GET_CONFIG      0xA1
 #define CMD_SET_CONFIG      0xA2
@@ -23,6 +36,14 @@
 #define RSP_ANGLES              0xD5
 #define RSP_ALL                 0xD6
 #define RSP_TEMPERATURE         0xD7
+#define RSP_SUN_VECTOR          0xD8
+#define RSP_BATCH               0xD9
+#define RSP_TRIGGER             0xDA
+#define RSP_FETCH               0xDB
+#define RSP_TIMING              0xDC
+#define RSP_STATS               0xDD
+#define RSP_ROI                 0xDE
+#define RSP_BURST               0xDF
 #define RSP_CONFIG              0xE1
 
 // Config sub commands
@@ -31,6 +52,93 @@
 #define CMD_CONFIG_SAT_LEVEL   0xB3
 #define CMD_CONFIG_INT         0xB4
 #define CMD_CONFIG_SAMPLING    0xB5
+#define CMD_CONFIG_ACQUISITION 0xB6
+#define CMD_CONFIG_ESTIMATOR   0xB7
+#define CMD_CONFIG_BAUD        0xB8
+#define CMD_CONFIG_BUS_SPEED   0xB9
+
+/*
+ * RSP_POSITION holds [x, y, SNR x, SNR y] and RSP_VECTOR [x, y, z, SNR x, SNR y]. The
+ * positions are calibrated center bins in 1/8 pixels with 1024 on the optical axis, and
+ * z is the pinhole height in the same units. CMD_GET_SUN_VECTOR normalizes
+ * (x - 1024, y - 1024, z). RSP_ANGLES holds the angles in millidegrees, an angle past
+ * 32.767 degrees is answered with RSP_STATUS_CALC_ERROR.
+ * CMD_CONFIG_CALIBRATION carries [X bias, Y bias, pinhole height in pixels, temperature
+ * bias]. A height below VALUE_Z_MIN (calc.h) is refused.
+ */
+
+/*
+ * CMD_GET_BATCH carries a list of command codes. CMD_GET_CONFIG is followed by its
+ * sub command. Accepted: CMD_GET_STATUS, CMD_GET_POSITION, CMD_GET_VECTOR,
+ * CMD_GET_ANGLES, CMD_GET_SUN_VECTOR, CMD_GET_TEMPERATURE and CMD_GET_CONFIG.
+ *
+ * RSP_BATCH holds one entry per command in the request order:
+ *   [response code, data length, data]
+ * The data is the same as in the response to the single command. A failed entry is
+ * RSP_STATUS with a status code. All the measurement entries come from one sample.
+ */
+#define BATCH_ENTRY_HEADER  2
+#define BATCH_ENTRY_MAX     32  // Longest entry data
+
+/*
+ * CMD_GET_RAW carries a part number. RSP_RAW holds [part, data]:
+ *   0-1  halves of the X profile, 128 pixels each
+ *   2-3  halves of the Y profile
+ *   4    both profiles packed losslessly (see rawpack.h)
+ *   5-6  the X or the Y profile packed
+ * A packed part which does not fit in one frame is answered with RSP_STATUS_ERROR.
+ * The master then asks for parts 5 and 6, and for parts 0-3 if they fail too.
+ */
+#define RAW_PART_PACKED     4
+#define RAW_PART_PACKED_X   5
+#define RAW_PART_PACKED_Y   6
+
+/*
+ * CMD_GET_ROI carries the window width in pixels, ROI_WIDTH_DEFAULT if left out. It
+ * measures like CMD_GET_POSITION and RSP_ROI holds the window around the peak of each
+ * axis:
+ *   [width, x start, x position (int16), x pixels, y start, y position (int16), y pixels]
+ * The window is centered on the maximum of the filtered profile and moved inside the
+ * sensor at the edges. The position is the one of RSP_POSITION. In continuous
+ * acquisition mode the frame info follows.
+ */
+#define ROI_WIDTH_DEFAULT   32
+#define ROI_WIDTH_MAX       120
+
+/*
+ * CMD_BURST_START carries the number of frames, up to BURST_FRAMES (calc.h). The next
+ * frames read out are stored in FRAM back to back, in any acquisition mode, until the
+ * sensor is put to sleep. A new burst overwrites the previous one.
+ *
+ * CMD_BURST_READ carries [frame, page] and RSP_BURST holds [frame, page, data]. The
+ * frame record is read in pages of BURST_PAGE_SIZE bytes:
+ *   [frame counter (uint16), sensor cycle (uint16), timestamp in ms (uint16),
+ *    INT_TIME (uint16), GAIN, 0, 256 X pixels, 256 Y pixels]
+ * The frames are consecutive when their sensor cycles are. A cycle is not read out
+ * while the previous frame has not been collected, which leaves a gap in the cycles.
+ * A frame still to be captured is answered with RSP_STATUS_NOT_READY, RSP_STATUS_ERROR
+ * if the burst stopped before it. The burst is kept over resets.
+ */
+#define BURST_PAGE_SIZE     240
+
+/*
+ * RSP_TIMING holds an entry per command:
+ *   [code, count (uint16), total (uint32), max (uint32)]
+ * The times are the handling times in 1.5 MHz stopwatch ticks, without the frame
+ * transfers. The counters are kept over resets. CMD_GET_TIMING with data 1 clears them
+ * after reading.
+ */
+#define TIMING_ENTRY_SIZE   11
+
+/*
+ * RSP_STATS holds uint32 counters since the reset in this order:
+ *   bus:      frames seen, frames to us, bytes, sync errors, length errors, CRC errors,
+ *             receive timeouts, frames skipped, bytes dropped for a full receive queue
+ *   pipeline: DMA timeouts, sampling errors, calc errors
+ *   power:    sleeps, wakeups
+ *   latency:  command service times < 1 ms, < 4 ms, < 16 ms, < 64 ms, < 256 ms, longer
+ * In the address-bit mode the frames to other devices are not seen.
+ */
 
 /* Status codes: */
 #define RSP_STATUS_OK                 0xF0
@@ -43,9 +151,43 @@
 #define RSP_STATUS_DIVISION_ZERO      0xF6
 #define RSP_STATUS_NOT_ODD            0xF7
 #define RSP_STATUS_CALC_ERROR         0xF8
+#define RSP_STATUS_NOT_READY          0xF9  // Followed by the ETA in ms (uint16)
+
+/*
+ * CMD_SYNC_TRIGGER carries a trigger ID (uint16) and is normally sent to
+ * BUS_ADDRESS_BROADCAST. Every sensor restarts its sampling sequence at the end of the
+ * frame, so the integrations begin at the same time, and nobody answers. The results
+ * are collected with CMD_FETCH using the trigger ID as the ticket.
+ * A sensor which is asleep wakes up and starts the sequence only after handling the
+ * frame in the main loop, so its integration begins later than on the awake sensors by
+ * the receive queue, the command handling and the wakeup. CMD_FETCH answers
+ * RSP_STATUS_SLEEP for a ticket the sensor does not know while it is asleep.
+ */
+
+/*
+ * CMD_REPEAT_LAST answers with the last response again, e.g. after a CRC error, without
+ * sampling the sensor again. RSP_STATUS_ERROR if it is no longer available.
+ *
+ * CMD_SEQUENCED wraps a command with a sequence number: [sequence number, command, data]
+ * The response is that of the command. A request with the same sequence number as the
+ * previous one from the same master is answered from the cache like CMD_REPEAT_LAST.
+ */
+
+// Shortest subscription period in ms
+#define SUBSCRIPTION_MIN_PERIOD 50
+
+#ifdef BUS_MASTERING_API
+/* Returns 1 when the subscribed telemetry should be published. */
+int subscription_due(void);
+
+/* Fill in the telemetry frame for the subscriber. */
+void subscription_publish(BusFrame* frame);
+#endif
 
 /* Subsystem-specific command handler.
- * Return 1 if there is a response, 0 if not. */
-void handle_command(const BusFrame* cmd, BusFrame* rsp);
+ * Return 1 if there is a response, 0 if not.
+ * The response is kept for a replay, so it must be sent from the given transmit slot.
+ * A sequenced command is unwrapped in place. */
+int handle_command(BusFrame* cmd, BusFrame* rsp);
 
 #endif